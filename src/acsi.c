@@ -0,0 +1,524 @@
+//----------------------------------------------------------------------------------
+// Atari ST emulator for Atari 68030
+// ACSI hard disk image emulation
+//----------------------------------------------------------------------------------
+#include "acsi.h"
+#include "dma.h"
+#include "h68k/h68k.h"
+#include "stdio.h"
+#include "string.h"
+
+//----------------------------------------------------------------------------------
+// ACSI target on the hard disk side of the dma chip, served from a raw disk
+// image that stays on the host filesystem.
+//
+// Images are too big to preload so sectors go through a cache of ACSI_LINE
+// sector lines, replaced least recently used. A miss reads the missing line,
+// the rest of the request and ACSI_READAHEAD lines beyond in a single call
+// into the host OS. Writes only go to the cache and are written back at the
+// next host call, when a dirty line is replaced, past ACSI_DIRTYMAX dirty
+// lines, once the client has left the dma alone for ACSI_IDLEVBL VBLs, on a
+// client reset or at shutdown.
+//
+// Host calls need the client ram apart from host memory (st_data != 0).
+// Other targets on the bus still go to the real hardware.
+//----------------------------------------------------------------------------------
+
+#define ACSI_ID         0           // target id of the image
+#define ACSI_SECTOR     512
+#define ACSI_LINE       8           // sectors per cache line
+#define ACSI_CACHE_KB   2048
+#define ACSI_READAHEAD  4           // lines read beyond a miss
+#define ACSI_FILLMAX    32          // lines read by one host call
+#define ACSI_DIRTYMAX   128         // dirty lines before a forced write back
+#define ACSI_IDLEVBL    50          // quiet VBLs before dirty lines are written back
+#define ACSI_HASH       256
+
+#define ACSI_LINEBYTES  (ACSI_SECTOR * ACSI_LINE)
+#define ACSI_LINES      ((ACSI_CACHE_KB * 1024) / ACSI_LINEBYTES)
+#define ACSI_NONE       0xFFFF
+#define ACSI_UNUSED     0xFFFFFFFF
+
+#define ACSI_ST_GOOD    0x00
+#define ACSI_ST_CHECK   0x02
+
+// sense key, additional sense code
+#define SENSE_NONE      0x00, 0x00
+#define SENSE_MEDIUM    0x03, 0x11  // unrecovered read error
+#define SENSE_WRITE     0x03, 0x0C  // write error
+#define SENSE_OPCODE    0x05, 0x20  // invalid command
+#define SENSE_RANGE     0x05, 0x21  // block out of range
+#define SENSE_PROTECT   0x07, 0x27  // write protected
+
+struct AcsiLine {
+    uint32  block;          // image sector / ACSI_LINE
+    uint32  stamp;          // last use
+    uint16  next;           // hash chain
+    uint8   valid;          // sector masks
+    uint8   dirty;
+};
+
+struct AcsiIo {
+    uint32  block[ACSI_FILLMAX];
+    uint16  count;
+    bool    ok;
+};
+
+FILE*   acsi_file;
+uint32  acsi_blocks;        // image size in sectors
+bool    acsi_readonly;
+
+struct AcsiLine* acsi_lines;
+uint8*  acsi_data;
+uint8*  acsi_scratch;       // partially valid lines are read through this
+uint16  acsi_hash[ACSI_HASH];
+uint32  acsi_clock;
+uint16  acsi_dirty;         // dirty lines
+uint16  acsi_idle;          // VBLs since the client last touched the dma
+h68kHostVector acsi_vbl_chain;
+
+uint16  acsi_mode;          // dma mode register
+bool    acsi_active;        // last command was for us
+uint8   acsi_cdb[16];
+uint8   acsi_len;
+uint8   acsi_need;
+uint8   acsi_status;
+uint8   acsi_sense_key;
+uint8   acsi_sense_asc;
+
+
+//----------------------------------------------------------------------------------
+// sector cache
+//----------------------------------------------------------------------------------
+uint8* AcsiLineData(struct AcsiLine* l) {
+    return acsi_data + ((l - acsi_lines) * ACSI_LINEBYTES);
+}
+
+struct AcsiLine* AcsiFind(uint32 block) {
+    uint16 idx = acsi_hash[block & (ACSI_HASH - 1)];
+    while (idx != ACSI_NONE) {
+        if (acsi_lines[idx].block == block)
+            return &acsi_lines[idx];
+        idx = acsi_lines[idx].next;
+    }
+    return 0;
+}
+
+struct AcsiLine* AcsiVictim() {
+    struct AcsiLine* l = &acsi_lines[0];
+    for (uint16 i=1; i<ACSI_LINES; i++) {
+        if (acsi_lines[i].stamp < l->stamp)
+            l = &acsi_lines[i];
+    }
+    return l;
+}
+
+// reuse the least recently used line for <block>, it must not be dirty
+struct AcsiLine* AcsiAlloc(uint32 block) {
+    struct AcsiLine* l = AcsiVictim();
+    uint16 idx = l - acsi_lines;
+    if (l->block != ACSI_UNUSED) {
+        uint16* p = &acsi_hash[l->block & (ACSI_HASH - 1)];
+        while (*p != idx)
+            p = &acsi_lines[*p].next;
+        *p = l->next;
+    }
+    uint16* head = &acsi_hash[block & (ACSI_HASH - 1)];
+    l->block = block;
+    l->next = *head;
+    l->valid = 0;
+    l->dirty = 0;
+    l->stamp = ++acsi_clock;
+    *head = idx;
+    return l;
+}
+
+bool AcsiWriteBack() {
+    bool ok = true;
+    for (uint16 i=0; (i<ACSI_LINES) && acsi_dirty; i++) {
+        struct AcsiLine* l = &acsi_lines[i];
+        if (l->dirty == 0)
+            continue;
+        for (uint16 s=0; s<ACSI_LINE; ) {
+            if (!(l->dirty & (1 << s))) {
+                s++;
+                continue;
+            }
+            uint16 e = s;
+            while ((e < ACSI_LINE) && (l->dirty & (1 << e)))
+                e++;
+            uint32 n = (e - s) * ACSI_SECTOR;
+            fseek(acsi_file, ((l->block * ACSI_LINE) + s) * ACSI_SECTOR, SEEK_SET);
+            if (fwrite(AcsiLineData(l) + (s * ACSI_SECTOR), 1, n, acsi_file) != n)
+                ok = false;
+            s = e;
+        }
+        l->dirty = 0;
+        acsi_dirty--;
+    }
+    fflush(acsi_file);
+    return ok;
+}
+
+bool AcsiReadLine(struct AcsiLine* l) {
+    uint32 sector = l->block * ACSI_LINE;
+    uint32 n = acsi_blocks - sector;
+    n = ((n < ACSI_LINE) ? n : ACSI_LINE) * ACSI_SECTOR;
+    uint8* dst = (l->valid == 0) ? AcsiLineData(l) : acsi_scratch;
+    fseek(acsi_file, sector * ACSI_SECTOR, SEEK_SET);
+    if (fread(dst, 1, n, acsi_file) != n)
+        return false;
+    if (dst == acsi_scratch) {
+        for (uint16 s=0; s<ACSI_LINE; s++) {
+            if (!(l->valid & (1 << s)))
+                CopyMem(AcsiLineData(l) + (s * ACSI_SECTOR), dst + (s * ACSI_SECTOR), ACSI_SECTOR);
+        }
+    }
+    l->valid = 0xFF;
+    return true;
+}
+
+// runs in the host OS
+void AcsiHostIo(void* user) {
+    struct AcsiIo* io = (struct AcsiIo*)user;
+    io->ok = AcsiWriteBack();
+    for (uint16 i=0; i<io->count; i++) {
+        struct AcsiLine* l = AcsiFind(io->block[i]);
+        if (l == 0)
+            l = AcsiAlloc(io->block[i]);
+        if (!AcsiReadLine(l))
+            io->ok = false;
+    }
+}
+
+bool AcsiSync() {
+    if (acsi_dirty == 0)
+        return true;
+    struct AcsiIo io;
+    io.count = 0;
+    h68k_HostCall(AcsiHostIo, &io);
+    return io.ok;
+}
+
+// line for reading sectors <mask> of <block>, <end> is the end of the request
+struct AcsiLine* AcsiLoad(uint32 block, uint8 mask, uint32 end) {
+    struct AcsiLine* l = AcsiFind(block);
+    if (l && ((l->valid & mask) == mask)) {
+        l->stamp = ++acsi_clock;
+        return l;
+    }
+    uint32 last = ((end + ACSI_LINE - 1) / ACSI_LINE) + ACSI_READAHEAD;
+    uint32 max = (acsi_blocks + ACSI_LINE - 1) / ACSI_LINE;
+    last = (last < max) ? last : max;
+
+    struct AcsiIo io;
+    io.count = 0;
+    io.block[io.count++] = block;
+    for (uint32 b=block+1; (b<last) && (io.count<ACSI_FILLMAX) && (AcsiFind(b) == 0); b++)
+        io.block[io.count++] = b;
+    h68k_HostCall(AcsiHostIo, &io);
+
+    l = AcsiFind(block);
+    return (l && ((l->valid & mask) == mask)) ? l : 0;
+}
+
+// line for writing <block>
+struct AcsiLine* AcsiStore(uint32 block) {
+    struct AcsiLine* l = AcsiFind(block);
+    if (l == 0) {
+        if (AcsiVictim()->dirty && !AcsiSync())
+            return 0;
+        l = AcsiAlloc(block);
+    }
+    l->stamp = ++acsi_clock;
+    return l;
+}
+
+
+//----------------------------------------------------------------------------------
+// commands
+//----------------------------------------------------------------------------------
+bool AcsiError(uint8 key, uint8 asc) {
+    acsi_sense_key = key;
+    acsi_sense_asc = asc;
+    acsi_status = (key || asc) ? ACSI_ST_CHECK : ACSI_ST_GOOD;
+    return false;
+}
+
+void AcsiReply(uint8* buf, uint32 size, uint32 alloc) {
+    uint32 addr = DmaAddress();
+    size = (size < alloc) ? size : alloc;
+    DmaCopy(addr, buf, size, true);
+    DmaSetAddress(addr + size);
+    h68k_FlushCache();
+}
+
+bool AcsiTransfer(uint32 sector, uint32 count, bool write) {
+    if ((sector > acsi_blocks) || (count > acsi_blocks - sector))
+        return AcsiError(SENSE_RANGE);
+    if (write && acsi_readonly)
+        return AcsiError(SENSE_PROTECT);
+
+    bool ok = true;
+    uint32 end = sector + count;
+    uint32 addr = DmaAddress();
+    while (sector < end) {
+        uint32 first = sector & (ACSI_LINE - 1);
+        uint32 n = ACSI_LINE - first;
+        n = (n < end - sector) ? n : end - sector;
+        uint8 mask = ((1 << n) - 1) << first;
+        uint32 block = sector / ACSI_LINE;
+
+        struct AcsiLine* l = write ? AcsiStore(block) : AcsiLoad(block, mask, end);
+        if (l == 0) {
+            ok = write ? AcsiError(SENSE_WRITE) : AcsiError(SENSE_MEDIUM);
+            break;
+        }
+        uint8* data = AcsiLineData(l) + (first * ACSI_SECTOR);
+        DmaCopy(addr, data, n * ACSI_SECTOR, !write);
+        if (write) {
+            if (l->dirty == 0)
+                acsi_dirty++;
+            l->valid |= mask;
+            l->dirty |= mask;
+        }
+        addr += n * ACSI_SECTOR;
+        sector += n;
+    }
+    DmaSetAddress(addr);
+    h68k_FlushCache();
+
+    if (acsi_dirty > ACSI_DIRTYMAX) {
+        if (!AcsiSync() && ok)
+            ok = AcsiError(SENSE_WRITE);
+    }
+    return ok;
+}
+
+uint8 AcsiCdbLength(uint8 op) {
+    switch (op >> 5) {
+        case 1: case 2: return 10;
+        case 5: return 12;
+        default: return 6;
+    }
+}
+
+void AcsiExecute() {
+    uint8 reply[36];
+    uint8* cdb = acsi_cdb;
+    uint8 op = cdb[0] & 0x1F;
+    if (op == 0x1F) {                               // icd extended command
+        cdb++;
+        op = cdb[0];
+    }
+    uint8 sense_key = acsi_sense_key;
+    uint8 sense_asc = acsi_sense_asc;
+    AcsiError(SENSE_NONE);
+    SetMem(reply, 0, sizeof(reply));
+
+    switch (op) {
+        case 0x00:                                  // test unit ready
+        case 0x1B:                                  // start/stop unit
+            break;
+
+        case 0x03:                                  // request sense
+            if (cdb[4] <= 4) {
+                reply[0] = sense_asc;
+                AcsiReply(reply, 4, 4);
+            } else {
+                reply[0] = 0x70;
+                reply[2] = sense_key;
+                reply[7] = 10;
+                reply[12] = sense_asc;
+                AcsiReply(reply, 18, cdb[4]);
+            }
+            break;
+
+        case 0x08:                                  // read(6)
+        case 0x0A:                                  // write(6)
+            AcsiTransfer(((cdb[1] & 0x1F) << 16) | (cdb[2] << 8) | cdb[3], cdb[4] ? cdb[4] : 256, op == 0x0A);
+            break;
+
+        case 0x12:                                  // inquiry
+            reply[2] = 1;
+            reply[4] = 31;
+            CopyMem(&reply[8], (uint8*)"Hyper68kACSI image      0100", 28);
+            AcsiReply(reply, 36, cdb[4]);
+            break;
+
+        case 0x1A:                                  // mode sense(6)
+            reply[0] = 11;
+            reply[2] = acsi_readonly ? 0x80 : 0x00;
+            reply[3] = 8;
+            reply[5] = acsi_blocks >> 16;
+            reply[6] = acsi_blocks >> 8;
+            reply[7] = acsi_blocks;
+            reply[10] = ACSI_SECTOR >> 8;
+            AcsiReply(reply, 12, cdb[4]);
+            break;
+
+        case 0x25:                                  // read capacity(10)
+            reply[0] = (acsi_blocks - 1) >> 24;
+            reply[1] = (acsi_blocks - 1) >> 16;
+            reply[2] = (acsi_blocks - 1) >> 8;
+            reply[3] = (acsi_blocks - 1);
+            reply[6] = ACSI_SECTOR >> 8;
+            AcsiReply(reply, 8, 8);
+            break;
+
+        case 0x28:                                  // read(10)
+        case 0x2A:                                  // write(10)
+            AcsiTransfer((cdb[2] << 24) | (cdb[3] << 16) | (cdb[4] << 8) | cdb[5], (cdb[7] << 8) | cdb[8], op == 0x2A);
+            break;
+
+        default:
+            AcsiError(SENSE_OPCODE);
+            break;
+    }
+}
+
+
+//----------------------------------------------------------------------------------
+// write back once the disk has gone quiet, no client transfer can be in flight then
+//----------------------------------------------------------------------------------
+bool OnVblAcsi(uint32 vec, uint16* frame) {
+    if (acsi_dirty && (++acsi_idle >= ACSI_IDLEVBL)) {
+        acsi_idle = 0;
+        AcsiSync();
+    }
+    return acsi_vbl_chain ? acsi_vbl_chain(vec, frame) : false;
+}
+
+void ResetAcsi() {
+    if (acsi_file == 0)
+        return;
+    AcsiSync();
+    acsi_active = false;
+    acsi_len = 0;
+    DmaClearIrq(DMA_IRQ_HDC);
+}
+
+
+//----------------------------------------------------------------------------------
+// dma io
+//----------------------------------------------------------------------------------
+bool AcsiReadWord(uint32 addr, uint16* data) {
+    acsi_idle = 0;
+    if (!acsi_active || !(acsi_mode & 0x08))
+        return false;
+    if (addr == 0xff8606) {
+        *data = 1;                                  // dma ok
+    } else if (acsi_mode & 0x10) {
+        return false;                               // sector count
+    } else {
+        *data = acsi_status;
+        DmaClearIrq(DMA_IRQ_HDC);
+    }
+    return true;
+}
+
+bool AcsiWriteWord(uint32 addr, uint16* data) {
+    acsi_idle = 0;
+    if (acsi_file == 0)
+        return false;
+    if (addr == 0xff8606) {
+        acsi_mode = *data;
+        return false;                               // hardware keeps the mode too
+    }
+    if (acsi_mode & 0x10)
+        return false;                               // sector count
+    if (!(acsi_mode & 0x08)) {
+        acsi_active = false;                        // fdc owns the dma now
+        return false;
+    }
+
+    uint8 d = *data;
+    if (!(acsi_mode & 0x02)) {                      // A0 low, first command byte
+        acsi_active = ((d >> 5) == ACSI_ID);
+        acsi_len = 0;
+        acsi_need = 6;
+    }
+    if (!acsi_active)
+        return false;
+    if (acsi_len >= acsi_need)
+        return true;                                // stray byte after the command
+
+    DmaClearIrq(DMA_IRQ_HDC);
+    acsi_cdb[acsi_len++] = d;
+    if ((acsi_len == 2) && ((acsi_cdb[0] & 0x1F) == 0x1F))
+        acsi_need = 1 + AcsiCdbLength(d);
+    if (acsi_len == acsi_need)
+        AcsiExecute();
+    DmaRaiseIrq(DMA_IRQ_HDC);
+    return true;
+}
+
+
+//----------------------------------------------------------------------------------
+// setup
+//----------------------------------------------------------------------------------
+bool InitAcsi(const char* filename)
+{
+    acsi_file = 0;
+    if (filename == 0)
+        return false;
+    if (st_data == 0) {
+        DPRINT(" Acsi: client ram overlaps the host");
+        return false;
+    }
+    FILE* f = fopen(filename, "r+b");
+    acsi_readonly = (f == 0);
+    if (f == 0)
+        f = fopen(filename, "rb");
+    if (f == 0)
+        return false;
+
+    fseek(f, 0, SEEK_END);
+    acsi_blocks = ftell(f) / ACSI_SECTOR;
+    fseek(f, 0, SEEK_SET);
+    if (acsi_blocks == 0) {
+        fclose(f);
+        return false;
+    }
+
+    if (acsi_data == 0) {
+        acsi_data = (uint8*)AllocMemEx(ACSI_LINES * ACSI_LINEBYTES, 16, MEM_ANY);
+        acsi_scratch = (uint8*)AllocMem(ACSI_LINEBYTES, 16);
+        acsi_lines = (struct AcsiLine*)AllocMem(ACSI_LINES * sizeof(struct AcsiLine), 4);
+    }
+    if ((acsi_data == 0) || (acsi_scratch == 0) || (acsi_lines == 0)) {
+        DPRINT(" Acsi: out of memory");
+        fclose(f);
+        return false;
+    }
+    for (uint16 i=0; i<ACSI_LINES; i++) {
+        acsi_lines[i].block = ACSI_UNUSED;
+        acsi_lines[i].stamp = 0;
+        acsi_lines[i].valid = 0;
+        acsi_lines[i].dirty = 0;
+    }
+    for (uint16 i=0; i<ACSI_HASH; i++) {
+        acsi_hash[i] = ACSI_NONE;
+    }
+    acsi_clock = 0;
+    acsi_dirty = 0;
+    acsi_idle = 0;
+    acsi_active = false;
+    acsi_mode = 0;
+    AcsiError(SENSE_NONE);
+
+    acsi_file = f;
+    acsi_vbl_chain = h68k_GetHostVector(0x70);
+    h68k_SetHostVector(0x70, OnVblAcsi);
+    DPRINT(" Acsi: id %d, %d sectors%s, %dKB cache", ACSI_ID, acsi_blocks, acsi_readonly ? " (readonly)" : "", ACSI_CACHE_KB);
+    return true;
+}
+
+void ShutdownAcsi()
+{
+    if (acsi_file == 0)
+        return;
+    AcsiWriteBack();
+    fclose(acsi_file);
+    acsi_file = 0;
+}
@@ -0,0 +1,16 @@
+//----------------------------------------------------------------------------------
+// Atari ST emulator for Atari 68030
+// ACSI hard disk image emulation
+//----------------------------------------------------------------------------------
+#ifndef _ACSI_H_
+#define _ACSI_H_
+
+#include "common.h"
+
+bool InitAcsi(const char* filename);                    // raw image, 512 byte sectors
+void ShutdownAcsi();                                    // write back, call with the host restored
+void ResetAcsi();                                       // write back, client reset
+bool AcsiReadWord(uint32 addr, uint16* data);           // dma io, true when handled
+bool AcsiWriteWord(uint32 addr, uint16* data);
+
+#endif // _ACSI_H_
@@ -73,61 +73,268 @@ void fatal(int arg) {
 
 
 //----------------------------------------------------------
-// Simple memory helpers
+// Memory allocator
+//
+// One address ordered free list per placement class, fed
+// with blocks from Mxalloc. Allocations carry a small
+// header in front so they can be freed, neighbouring free
+// blocks are merged.
+//
+// The lists grow from GEMDOS on demand, until LockMem()
+// which must be called before GEMDOS becomes unavailable.
 //----------------------------------------------------------
-uint32 mem_ptr, mem_top;
+#define MEM_CLASSES     4
+#define MEM_GROWSIZE    (256 * 1024)
+#define MEM_MINBLOCK    16
+
+struct memBlock {
+    uint32 size;                    // free: size of block, used: size of span | class
+    struct memBlock* next;          // free: next block,    used: start of span
+};
+
+struct memBlock* mem_free[MEM_CLASSES];
+uint32 mem_avail[MEM_CLASSES];
+bool mem_locked;
+
+static void FreeBlock(uint16 type, uint32 addr, uint32 size) {
+    struct memBlock* prev = 0;
+    struct memBlock* next = mem_free[type];
+    while (next && ((uint32)next < addr)) {
+        prev = next;
+        next = next->next;
+    }
+    mem_avail[type] += size;
+    struct memBlock* b = (struct memBlock*)addr;
+    b->size = size;
+    b->next = next;
+    if (next && ((addr + size) == (uint32)next)) {          // merge with next
+        b->size += next->size;
+        b->next = next->next;
+    }
+    if (prev && (((uint32)prev + prev->size) == addr)) {    // merge with previous
+        prev->size += b->size;
+        prev->next = b->next;
+    } else if (prev) {
+        prev->next = b;
+    } else {
+        mem_free[type] = b;
+    }
+}
 
-// todo: maybe just use Mxalloc instead of fixed pool
+static bool GrowMem(uint16 type, uint32 size) {
+    if (mem_locked)
+        return false;
+    size = (size + 15) & ~15;
+    uint32 m = (uint32)Mxalloc(size + 16, type);
+    if ((m == 0) || (m == (uint32)-32))                     // no memory, or no Mxalloc
+        return false;
+    m = (m + 15) & ~15;                                     // keeps the class bits in headers free
+    DPRINT(" Mem: 0x%08x : %dKb (%d)", m, size / 1024, type);
+    FreeBlock(type, m, size);
+    return true;
+}
 
 uint32 InitMem(uint32 size) {
-    uint32 mem_size = size;
-    mem_ptr = Mxalloc(mem_size, 1);
-    ASSERT(mem_ptr != 0, "Failed to allocate %d", mem_size);
-    mem_top = mem_ptr + mem_size;
-    memset((void*)mem_ptr, 0, mem_size);
-    DPRINT(" Mem: 0x%08x : %dKb", (uint32)mem_ptr, (uint32)mem_top - (uint32)mem_ptr);
-    return mem_size;
+    for (uint16 i=0; i<MEM_CLASSES; i++) {
+        mem_free[i] = 0;
+        mem_avail[i] = 0;
+    }
+    mem_locked = false;
+    bool ok = GrowMem(MEM_ANY, size);
+    ASSERT(ok, "Failed to allocate %d", size);
+    return ok ? size : 0;
 }
 
-uint32 AllocMem(uint32 size, uint32 alignment) {
-    uint32 a = (alignment - 1);
-    uint32 m = (mem_ptr + a) & ~a;
-    ASSERT((m+size)<=mem_top, "Failed alloc %d:%d", size, alignment);
-    if ((m + size) <= mem_top) {
-        DPRINT("alloc: %d, free: %d", ((m + size) - mem_ptr), (mem_top - (m + size)));
-        mem_ptr = m + size;
-        return m;
-    }
+void LockMem(bool lock) {
+    mem_locked = lock;
+}
 
+uint32 AllocMemEx(uint32 size, uint32 alignment, uint16 type) {
+    uint32 a = (alignment < 4) ? 3 : (alignment - 1);
+    size = (size + 3) & ~3;
+    for (uint16 tries=0; tries<2; tries++) {
+        struct memBlock** prev = &mem_free[type];
+        for (struct memBlock* b = *prev; b; prev = &b->next, b = b->next) {
+            uint32 start = (uint32)b;
+            uint32 end = start + b->size;
+            uint32 m = (start + sizeof(struct memBlock) + a) & ~a;
+            if ((m + size) > end)
+                continue;
+            // take the block off the list, and return what's left on either side
+            *prev = b->next;
+            mem_avail[type] -= b->size;
+            uint32 span = m - sizeof(struct memBlock);
+            if ((span - start) >= MEM_MINBLOCK) {
+                FreeBlock(type, start, span - start);
+                start = span;
+            }
+            if ((end - (m + size)) >= MEM_MINBLOCK) {
+                FreeBlock(type, m + size, end - (m + size));
+                end = m + size;
+            }
+            struct memBlock* h = (struct memBlock*)span;
+            h->size = (end - start) | type;
+            h->next = (struct memBlock*)start;
+            SetMem((uint8*)m, 0, size);
+            return m;
+        }
+        // nothing fits, get more from the os
+        uint32 grow = size + a + sizeof(struct memBlock);
+        if (!GrowMem(type, (grow > MEM_GROWSIZE) ? grow : MEM_GROWSIZE))
+            break;
+    }
+    // fast ram is only a preference for MEM_ANY
+    if (type == MEM_ANY)
+        return AllocMemEx(size, alignment, MEM_ST);
+    ASSERT(0, "Failed alloc %d:%d (%d)", size, alignment, type);
     return 0;
 }
 
+uint32 AllocMem(uint32 size, uint32 alignment) {
+    return AllocMemEx(size, alignment, MEM_ANY);
+}
+
+void FreeMem(uint32 ptr) {
+    if (ptr == 0)
+        return;
+    struct memBlock* h = (struct memBlock*)(ptr - sizeof(struct memBlock));
+    FreeBlock(h->size & 3, (uint32)h->next, h->size & ~3);
+}
+
+//----------------------------------------------------------
+// Copy and fill
+//
+// Destination is long aligned and bulk moved in 32 byte
+// blocks with movem, the rest a long or byte at a time.
+// The 68030 handles a misaligned source on its own.
+// CopyMem does not handle overlap.
+//----------------------------------------------------------
 void CopyMem(uint8* dst, uint8* src, uint32 cnt) {
-    memcpy(dst, src, cnt);
+    if (cnt >= 64) {
+        while ((uint32)dst & 3) {
+            *dst++ = *src++; cnt--;
+        }
+        uint32 blocks = cnt >> 5;
+        cnt &= 31;
+        __asm__ __volatile__ (          \
+            "                           \
+        1:  movem.l (%1)+,d1-d7/a2;     \
+            movem.l d1-d7/a2,(%0);      \
+            lea     32(%0),%0;          \
+            subq.l  #1,%2;              \
+            bne.b   1b;                 \
+            "                           \
+            : "+a"(dst), "+a"(src), "+d"(blocks) : : "d1", "d2", "d3", "d4", "d5", "d6", "d7", "a2", "cc", "memory" );
+    }
+    while (cnt >= 4) {
+        *((uint32*)dst) = *((uint32*)src);
+        dst += 4; src += 4; cnt -= 4;
+    }
+    while (cnt--) {
+        *dst++ = *src++;
+    }
 }
 
 void SetMem(uint8* dst, uint8 val, uint32 cnt) {
-    memset(dst, val, cnt);
+    uint32 v = (uint32)val * 0x01010101u;
+    if (cnt >= 64) {
+        while ((uint32)dst & 3) {
+            *dst++ = val; cnt--;
+        }
+        uint32 blocks = cnt >> 5;
+        dst += (blocks << 5);
+        cnt &= 31;
+        uint8* end = dst;
+        __asm__ __volatile__ (          \
+            "                           \
+            move.l  %2,d1;              \
+            move.l  d1,d2;              \
+            move.l  d1,d3;              \
+            move.l  d1,d4;              \
+            move.l  d1,d5;              \
+            move.l  d1,d6;              \
+            move.l  d1,d7;              \
+            move.l  d1,a2;              \
+        1:  movem.l d1-d7/a2,-(%0);     \
+            subq.l  #1,%1;              \
+            bne.b   1b;                 \
+            "                           \
+            : "+a"(end), "+d"(blocks) : "d"(v) : "d1", "d2", "d3", "d4", "d5", "d6", "d7", "a2", "cc", "memory" );
+    }
+    while (cnt >= 4) {
+        *((uint32*)dst) = v;
+        dst += 4; cnt -= 4;
+    }
+    while (cnt--) {
+        *dst++ = val;
+    }
 }
 
+//----------------------------------------------------------
+// Pattern search
+//
+// Patterns are word arrays with the length in words first.
+// FindMemMulti scans once for up to FINDMEM_MAX patterns,
+// bucketed on their first word, and reports every match.
+//----------------------------------------------------------
+#define FINDMEM_HASH(w) (((w) ^ ((w) >> 6) ^ ((w) >> 12)) & 63)
+
 uint16* FindMem(uint8* mem, uint32 size, const uint16* pattern)
 {
     uint16 s = pattern[0];
     uint16* r = (uint16*)mem;
-    for (uint32 i=0; i<size/2; i++) {
-        bool found = 1;
-        for (uint16 j=0; j<s; j++) {
-            if (r[i+j] != pattern[j+1]) {
-                found = 0;
-            }
-        }
-        if (found) {
+    uint32 words = size / 2;
+    if ((s == 0) || (s > words))
+        return 0;
+    for (uint32 i=0; i<=words-s; i++) {
+        if (r[i] != pattern[1])
+            continue;
+        uint16 j = 1;
+        while ((j < s) && (r[i+j] == pattern[j+1]))
+            j++;
+        if (j == s)
             return &r[i];
-        }
     }
     return 0;
 }
 
+uint16 FindMemMulti(uint8* mem, uint32 size, const uint16* const* patterns, uint16 count, void(*found)(uint16 idx, uint16* addr, void* user), void* user)
+{
+    uint8 head[64];
+    uint8 next[FINDMEM_MAX];
+    uint16* r = (uint16*)mem;
+    uint32 words = size / 2;
+    uint16 matches = 0;
+
+    ASSERT(count <= FINDMEM_MAX, "FindMemMulti: too many patterns");
+    SetMem(head, 0xff, sizeof(head));
+    for (sint16 k=count-1; k>=0; k--) {                      // chains in list order
+        if (patterns[k][0] == 0)
+            continue;
+        uint16 h = FINDMEM_HASH(patterns[k][1]);
+        next[k] = head[h];
+        head[h] = k;
+    }
+
+    for (uint32 i=0; i<words; i++) {
+        uint16 w = r[i];
+        for (uint8 k=head[FINDMEM_HASH(w)]; k!=0xff; k=next[k]) {
+            const uint16* p = patterns[k];
+            uint16 s = p[0];
+            if ((p[1] != w) || (s > words - i))
+                continue;
+            uint16 j = 1;
+            while ((j < s) && (r[i+j] == p[j+1]))
+                j++;
+            if (j == s) {
+                matches++;
+                found(k, &r[i], user);
+            }
+        }
+    }
+    return matches;
+}
+
 
 
 //----------------------------------------------------------
@@ -64,11 +64,21 @@ typedef short           bool;
 extern int appmain(int args, char** argv);
 extern void fatal(int arg);
 
+#define MEM_ST          0       // st-ram, for dma and video
+#define MEM_FAST        1       // tt/fast-ram only
+#define MEM_ANY         3       // fast-ram if there is any, else st-ram
+
 extern uint32 InitMem(uint32 size);
+extern void LockMem(bool lock);
 extern uint32 AllocMem(uint32 size, uint32 alignment);
+extern uint32 AllocMemEx(uint32 size, uint32 alignment, uint16 type);
+extern void FreeMem(uint32 ptr);
 extern void CopyMem(uint8* dst, uint8* src, uint32 cnt);
 extern void SetMem(uint8* dst, uint8 val, uint32 cnt);
 extern uint16* FindMem(uint8* mem, uint32 size, const uint16* pattern);
+extern uint16 FindMemMulti(uint8* mem, uint32 size, const uint16* const* patterns, uint16 count, void(*found)(uint16 idx, uint16* addr, void* user), void* user);
+
+#define FINDMEM_MAX     64
 
 
 #endif // _COMMON_H_
@@ -0,0 +1,21 @@
+//----------------------------------------------------------------------------------
+// Atari ST emulator for Atari 68030
+// Dma chip helpers for emulated fdc / hdc devices (main.c)
+//----------------------------------------------------------------------------------
+#ifndef _DMA_H_
+#define _DMA_H_
+
+#include "common.h"
+
+#define DMA_IRQ_FDC     0x01
+#define DMA_IRQ_HDC     0x02
+
+extern uint32 st_data;
+
+uint32 DmaAddress();                                        // client address the dma points at
+void   DmaSetAddress(uint32 addr);
+void   DmaCopy(uint32 laddr, uint8* buf, uint32 size, bool toclient);  // flush cache when done
+void   DmaRaiseIrq(uint8 src);                              // pull GPIP bit 5 low for <src>
+void   DmaClearIrq(uint8 src);
+
+#endif // _DMA_H_
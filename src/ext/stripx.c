@@ -30,6 +30,7 @@
 static unsigned char mybuf[NEWBUFSIZ];
 static int verbose;
 static int singletask;
+static int ttram;
 static int force;
 
 static char tmpname[1024];
@@ -135,6 +136,11 @@ static int write_head(int fd, const struct aexec *a)
 		prgFlags |= 0x10000;	// FreeMiNT: singletasking application
 		prgFlags |= 0x10;		// Memory protection mode: Global
 	}
+	if (ttram)
+	{
+		prgFlags |= 0x02;		// load into TT-RAM
+		prgFlags |= 0x04;		// Malloc from TT-RAM
+	}
 	write_beword(buf, a->a_magic);
 	write_belong(buf + 2, a->a_text);
 	write_belong(buf + 6, a->a_data);
@@ -482,7 +488,7 @@ static int strip(const char *name)
 static void usage(const char *s)
 {
 	fprintf(stderr, "%s", s);
-	fprintf(stderr, "Usage: stripex [-f] files ...\n");
+	fprintf(stderr, "Usage: stripex [-f] [-s] [-t] [-v] files ...\n");
 	fprintf(stderr, "strip GNU-binutils aexec header from executables\n");
 	exit(1);
 }
@@ -494,6 +500,7 @@ int main(int argc, char **argv)
 
 	verbose = 0;
 	singletask = 0;
+	ttram = 0;
 	
 	/* process arguments */
 	while (argv++, --argc)
@@ -506,6 +513,9 @@ int main(int argc, char **argv)
 		case 's':
 			singletask = 1;
 			break;
+		case 't':
+			ttram = 1;
+			break;
 		case 'v':
 			verbose = 1;
 			break;
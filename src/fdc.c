@@ -0,0 +1,440 @@
+//----------------------------------------------------------------------------------
+// Atari ST emulator for Atari 68030
+// Floppy disk image emulation
+//----------------------------------------------------------------------------------
+#include "fdc.h"
+#include "dma.h"
+#include "h68k/h68k.h"
+#include "stdio.h"
+#include "string.h"
+
+//----------------------------------------------------------------------------------
+// WD1772 and the floppy side of the dma chip for drive A, served from a disk
+// image loaded into memory at startup. Changes are kept for the session only.
+//
+// A whole command completes as one copy between the image and client ram.
+// With <realtime> completion waits for roughly the time the real drive would
+// take, counted in VBLs.
+//
+// Hard disk accesses (dma mode bit 3) and accesses while drive A isn't selected
+// still go to the real hardware.
+// The controller interrupt reaches the client through GPIP bit 5, which TOS
+// polls, and as an MFP interrupt when the client has enabled it.
+//----------------------------------------------------------------------------------
+
+#define FDC_ST_BUSY     0x01
+#define FDC_ST_INDEX    0x02    // type I
+#define FDC_ST_DRQ      0x02    // type II/III
+#define FDC_ST_TRACK0   0x04    // type I
+#define FDC_ST_LOST     0x04    // type II/III
+#define FDC_ST_CRC      0x08
+#define FDC_ST_RNF      0x10
+#define FDC_ST_SPINUP   0x20
+#define FDC_ST_WPROT    0x40
+#define FDC_ST_MOTOR    0x80
+
+#define FDC_SECTOR      512
+#define FDC_MS_PER_VBL  20
+
+uint8*  fdc_img;        // raw image, track by track with sides interleaved
+uint32  fdc_size;
+uint16  fdc_spt;
+uint16  fdc_sides;
+uint16  fdc_tracks;
+bool    fdc_realtime;
+
+uint16  fdc_mode;       // dma mode register
+uint16  fdc_count;      // dma sector count
+uint8   fdc_status;
+uint8   fdc_cmd;
+uint8   fdc_track;
+uint8   fdc_sector;
+uint8   fdc_data;
+uint8   fdc_head;       // physical head position
+sint8   fdc_dir;
+uint16  fdc_delay;      // (realtime) VBLs until the command completes
+uint8   psg_reg;
+uint8   psg_porta = 0xFF;
+
+h68kHostVector fdc_vbl_chain;
+
+void FdcExecute();
+
+//----------------------------------------------------------------------------------
+// command completion
+//----------------------------------------------------------------------------------
+void FdcComplete() {
+    FdcExecute();
+    h68k_FlushCache();
+    fdc_status &= ~FDC_ST_BUSY;
+    DmaRaiseIrq(DMA_IRQ_FDC);
+}
+
+bool OnVblFdc(uint32 vec, uint16* frame) {
+    if (fdc_delay && (--fdc_delay == 0))
+        FdcComplete();
+    return fdc_vbl_chain ? fdc_vbl_chain(vec, frame) : false;
+}
+
+void FdcStart(uint32 ms) {
+    fdc_status = FDC_ST_BUSY | FDC_ST_MOTOR;
+    DmaClearIrq(DMA_IRQ_FDC);
+    if (fdc_realtime) {
+        fdc_delay = 1 + (ms / FDC_MS_PER_VBL);
+    } else {
+        FdcComplete();
+    }
+}
+
+//----------------------------------------------------------------------------------
+// commands
+//----------------------------------------------------------------------------------
+bool FdcSelected() {
+    return (psg_porta & 0x02) == 0;             // drive A select, active low
+}
+
+uint8* FdcSectorData(uint8 sector) {
+    uint16 side = (psg_porta & 0x01) ? 0 : 1;
+    if (!FdcSelected() || (fdc_track != fdc_head) || (fdc_head >= fdc_tracks) ||
+        (side >= fdc_sides) || (sector == 0) || (sector > fdc_spt))
+        return 0;
+    uint32 idx = (((fdc_head * fdc_sides) + side) * fdc_spt) + (sector - 1);
+    return &fdc_img[idx * FDC_SECTOR];
+}
+
+void FdcTypeI() {
+    uint8 cmd = fdc_cmd;
+    switch (cmd >> 5) {
+        case 0:
+            if (cmd & 0x10) {                   // seek
+                fdc_dir = (fdc_data > fdc_track) ? 1 : -1;
+                sint16 head = (sint16)fdc_head + (sint16)fdc_data - (sint16)fdc_track;
+                fdc_head = (head < 0) ? 0 : (head > 85) ? 85 : head;
+                fdc_track = fdc_data;
+            } else {                            // restore
+                fdc_dir = -1;
+                fdc_head = 0;
+                fdc_track = 0;
+            }
+            break;
+        default: {                              // step, step-in, step-out
+            fdc_dir = ((cmd >> 5) == 2) ? 1 : ((cmd >> 5) == 3) ? -1 : fdc_dir;
+            if ((fdc_dir > 0) && (fdc_head < 85))
+                fdc_head++;
+            else if ((fdc_dir < 0) && (fdc_head > 0))
+                fdc_head--;
+            if (cmd & 0x10)
+                fdc_track += fdc_dir;
+            break;
+        }
+    }
+    fdc_status = FDC_ST_MOTOR | FDC_ST_SPINUP;
+    fdc_status |= (fdc_head == 0) ? FDC_ST_TRACK0 : 0;
+    if ((cmd & 0x04) && (!FdcSelected() || (fdc_head >= fdc_tracks) || (fdc_track != fdc_head)))
+        fdc_status |= FDC_ST_RNF;               // verify
+}
+
+void FdcTypeII() {
+    bool write = (fdc_cmd & 0x20) != 0;
+    bool multi = (fdc_cmd & 0x10) != 0;
+    uint32 addr = DmaAddress();
+    fdc_status = FDC_ST_MOTOR;
+    do {
+        uint8* data = FdcSectorData(fdc_sector);
+        if (data == 0) {
+            fdc_status |= FDC_ST_RNF;
+            break;
+        }
+        if (fdc_count) {
+            DmaCopy(addr, data, FDC_SECTOR, !write);
+            addr += FDC_SECTOR;
+            fdc_count--;
+        } else {
+            fdc_status |= FDC_ST_LOST;          // dma wasn't ready for it
+        }
+        if (multi)
+            fdc_sector++;               // only multi sector commands advance it
+    } while (multi);
+    DmaSetAddress(addr);
+}
+
+void FdcTypeIII() {
+    fdc_status = FDC_ST_MOTOR;
+    if ((fdc_cmd & 0xF0) == 0xC0) {             // read address
+        uint16 side = (psg_porta & 0x01) ? 0 : 1;
+        uint8 id[6] = { fdc_head, side, fdc_sector, 2, 0, 0 };
+        if (!FdcSelected() || (fdc_head >= fdc_tracks)) {
+            fdc_status |= FDC_ST_RNF;
+        } else if (fdc_count) {
+            uint32 addr = DmaAddress();
+            DmaCopy(addr, id, 6, true);
+            DmaSetAddress(addr + 6);
+            fdc_sector = fdc_head;              // track register gets the track id
+        }
+    } else {
+        fdc_status |= FDC_ST_RNF;               // read/write track, not from an image
+    }
+}
+
+void FdcExecute() {
+    switch (fdc_cmd >> 4) {
+        case 0x0: case 0x1: case 0x2: case 0x3:
+        case 0x4: case 0x5: case 0x6: case 0x7:
+            FdcTypeI();
+            break;
+        case 0x8: case 0x9: case 0xA: case 0xB:
+            FdcTypeII();
+            break;
+        case 0xC: case 0xE: case 0xF:
+            FdcTypeIII();
+            break;
+    }
+}
+
+void FdcCommand(uint8 cmd) {
+    if ((cmd & 0xF0) == 0xD0) {                 // force interrupt
+        fdc_delay = 0;
+        fdc_status &= ~FDC_ST_BUSY;
+        DmaClearIrq(DMA_IRQ_FDC);
+        if (cmd & 0x08)
+            DmaRaiseIrq(DMA_IRQ_FDC);
+        return;
+    }
+    if (fdc_status & FDC_ST_BUSY)
+        return;
+    fdc_cmd = cmd;
+    uint32 ms;
+    if (cmd < 0x80) {
+        uint32 steps = (cmd < 0x20) ? ((cmd & 0x10) ? (fdc_data > fdc_track ? fdc_data - fdc_track : fdc_track - fdc_data) : fdc_head) : 1;
+        ms = steps * 3;
+    } else if (cmd < 0xC0) {
+        bool valid = (fdc_sector >= 1) && (fdc_sector <= fdc_spt);
+        uint32 sectors = ((cmd & 0x10) && valid) ? (fdc_spt + 1 - fdc_sector) : 1;
+        ms = 100 + (sectors * 20);              // half a turn, then 20ms per sector
+    } else {
+        ms = 200;
+    }
+    FdcStart(ms);
+}
+
+//----------------------------------------------------------------------------------
+// io handlers
+//----------------------------------------------------------------------------------
+bool FloppyReadWord(uint32 addr, uint16* data) {
+    if ((fdc_img == 0) || (fdc_mode & 0x08) || !FdcSelected())
+        return false;                           // no image, hard disk, or another drive
+    if (addr == 0xff8606) {
+        *data = 1 | (fdc_count ? 2 : 0);        // copies from an image never fail
+    } else if (fdc_mode & 0x10) {
+        *data = fdc_count;
+    } else {
+        switch ((fdc_mode >> 1) & 3) {
+            case 0: *data = fdc_status; DmaClearIrq(DMA_IRQ_FDC); break;
+            case 1: *data = fdc_track; break;
+            case 2: *data = fdc_sector; break;
+            case 3: *data = fdc_data; break;
+        }
+    }
+    return true;
+}
+
+bool FloppyWriteWord(uint32 addr, uint16* data) {
+    if (fdc_img == 0)
+        return false;
+    if (addr == 0xff8606) {
+        if ((fdc_mode ^ *data) & 0x100)         // direction toggle resets the dma
+            fdc_count = 0;
+        fdc_mode = *data;
+        return false;                           // hardware keeps the mode for the hard disk
+    }
+    if ((fdc_mode & 0x08) || !FdcSelected())
+        return false;
+    if (fdc_mode & 0x10) {
+        fdc_count = *data & 0xFF;
+    } else {
+        uint8 d = *data;
+        switch ((fdc_mode >> 1) & 3) {
+            case 0: FdcCommand(d); break;
+            case 1: if (!(fdc_status & FDC_ST_BUSY)) fdc_track = d; break;
+            case 2: if (!(fdc_status & FDC_ST_BUSY)) fdc_sector = d; break;
+            case 3: fdc_data = d; break;
+        }
+    }
+    return true;
+}
+
+// psg port A has drive and side select
+void wb_psg(uint32 addr, uint8* data) {
+    if (addr & 2) {
+        if (psg_reg == 14)
+            psg_porta = *data;
+    } else {
+        psg_reg = *data & 0x0F;
+    }
+    h68k_IoWriteBytePT(addr, data);
+}
+
+void ww_psg(uint32 addr, uint16* data) {
+    uint8 d = *data >> 8;
+    if (addr & 2) {
+        if (psg_reg == 14)
+            psg_porta = d;
+    } else {
+        psg_reg = d & 0x0F;
+    }
+    h68k_IoWriteWordPT(addr, data);
+}
+
+// move.l #$0e00xx00,$ff8800 selects and writes in one go
+void wl_psg(uint32 addr, uint32* data) {
+    uint16 d[2] = { *data >> 16, *data };
+    ww_psg(addr, &d[0]);
+    ww_psg(addr + 2, &d[1]);
+}
+
+//----------------------------------------------------------------------------------
+// disk images
+//----------------------------------------------------------------------------------
+static uint16 ReadLE16(uint8* p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint16 ReadBE16(uint8* p) {
+    return (p[0] << 8) | p[1];
+}
+
+// geometry from the boot sector, or guessed from the image size when the
+// boot sector has none (game disks often leave the sector count at 0)
+bool FdcGeometry(uint8* img, uint32 size) {
+    uint32 total = ReadLE16(&img[0x13]);
+    fdc_spt = ReadLE16(&img[0x18]);
+    fdc_sides = ReadLE16(&img[0x1A]);
+    if ((fdc_spt >= 8) && (fdc_spt <= 12) && (fdc_sides >= 1) && (fdc_sides <= 2) &&
+        (total * FDC_SECTOR <= size) && ((total % (fdc_spt * fdc_sides)) == 0)) {
+        fdc_tracks = total / (fdc_spt * fdc_sides);
+        if ((fdc_tracks > 0) && (fdc_tracks <= 86))
+            return true;
+    }
+    for (fdc_sides = 2; fdc_sides >= 1; fdc_sides--) {
+        for (fdc_spt = 9; fdc_spt <= 12; fdc_spt++) {
+            for (fdc_tracks = 80; fdc_tracks <= 86; fdc_tracks++) {
+                if (fdc_tracks * fdc_sides * fdc_spt * FDC_SECTOR == size)
+                    return true;
+            }
+        }
+    }
+    for (fdc_tracks = 40; fdc_tracks <= 42; fdc_tracks++) {
+        fdc_sides = 1; fdc_spt = 9;
+        if (fdc_tracks * fdc_spt * FDC_SECTOR == size)
+            return true;
+    }
+    return false;
+}
+
+// .msa : header, then each track as raw or E5 run length encoded data
+bool FdcUnpackMsa(uint8* msa, uint32 size) {
+    if ((size < 10) || (ReadBE16(&msa[0]) != 0x0E0F))
+        return false;
+    fdc_spt = ReadBE16(&msa[2]);
+    fdc_sides = ReadBE16(&msa[4]) + 1;
+    uint16 first = ReadBE16(&msa[6]);
+    uint16 last = ReadBE16(&msa[8]);
+    if ((fdc_spt == 0) || (fdc_spt > 12) || (fdc_sides > 2) || (last < first) || (last > 85))
+        return false;
+
+    fdc_tracks = last + 1;
+    uint32 tracksize = fdc_spt * FDC_SECTOR;
+    fdc_size = fdc_tracks * fdc_sides * tracksize;
+    fdc_img = (uint8*)AllocMem(fdc_size, 4);    // cleared
+
+    uint8* src = &msa[10];
+    uint8* end = &msa[size];
+    for (uint32 t = first * fdc_sides; t < fdc_tracks * fdc_sides; t++) {
+        if (src + 2 > end)
+            return false;
+        uint32 len = ReadBE16(src); src += 2;
+        if (src + len > end)
+            return false;
+        uint8* dst = &fdc_img[t * tracksize];
+        if (len == tracksize) {
+            CopyMem(dst, src, len);
+        } else {
+            uint8* s = src;
+            uint8* d = dst;
+            while ((s < src + len) && (d < dst + tracksize)) {
+                if ((*s == 0xE5) && (s + 4 <= src + len)) {
+                    uint8 b = s[1];
+                    uint32 n = ReadBE16(&s[2]);
+                    n = (n < (uint32)(dst + tracksize - d)) ? n : (uint32)(dst + tracksize - d);
+                    SetMem(d, b, n);
+                    d += n; s += 4;
+                } else {
+                    *d++ = *s++;
+                }
+            }
+        }
+        src += len;
+    }
+    return true;
+}
+
+bool InitFloppy(const char* filename, bool realtime)
+{
+    fdc_img = 0;
+    if (filename == 0)
+        return false;
+    DPRINT("Loading '%s'", filename);
+    FILE* f = fopen(filename, "rb");
+    if (f == 0) {
+        DPRINT(" Floppy: failed opening '%s'", filename);
+        return false;
+    }
+    fseek(f, 0, SEEK_END);
+    uint32 filesize = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8* file = (uint8*)AllocMem(filesize, 4);
+    uint32 size = fread(file, 1, filesize, f);
+    fclose(f);
+    if ((size != filesize) || (size < FDC_SECTOR)) {
+        FreeMem((uint32)file);
+        return false;
+    }
+
+    uint32 len = strlen(filename);
+    bool msa = (len > 4) && (stricmp(&filename[len - 4], ".msa") == 0);
+    bool ok;
+    if (msa) {
+        ok = FdcUnpackMsa(file, size);
+        FreeMem((uint32)file);
+    } else {
+        fdc_img = file;
+        fdc_size = size;
+        ok = FdcGeometry(file, size);
+    }
+    if (!ok) {
+        DPRINT(" Floppy: unknown image format");
+        FreeMem((uint32)fdc_img);
+        fdc_img = 0;
+        return false;
+    }
+    DPRINT(" Floppy: %d tracks, %d sides, %d sectors%s", fdc_tracks, fdc_sides, fdc_spt, realtime ? " (realtime)" : "");
+
+    fdc_realtime = realtime;
+    fdc_status = 0;
+    fdc_head = 0;
+    fdc_dir = 1;
+
+    // drive and side select
+    h68k_MapIoRangeEx(0xff8800, 0xff8900, h68k_IoReadBytePT, h68k_IoWriteBytePT, h68k_IoReadWordPT, h68k_IoWriteWordPT, h68k_IoReadLongPT, h68k_IoWriteLongPT);
+    for (uint32 i=0xff8800; i<0xff8900; i+=2) {
+        h68k_MapIoByte(i, h68k_IoReadBytePT, wb_psg);
+        h68k_MapIoWord(i, h68k_IoReadWordPT, ww_psg);
+        h68k_MapIoLong(i, h68k_IoReadLongPT, wl_psg);
+    }
+
+    if (realtime) {
+        fdc_vbl_chain = h68k_GetHostVector(0x70);
+        h68k_SetHostVector(0x70, OnVblFdc);
+    }
+    return true;
+}
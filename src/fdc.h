@@ -0,0 +1,14 @@
+//----------------------------------------------------------------------------------
+// Atari ST emulator for Atari 68030
+// Floppy disk image emulation
+//----------------------------------------------------------------------------------
+#ifndef _FDC_H_
+#define _FDC_H_
+
+#include "common.h"
+
+bool InitFloppy(const char* filename, bool realtime);   // .st or .msa image for drive A
+bool FloppyReadWord(uint32 addr, uint16* data);         // dma io, true when handled
+bool FloppyWriteWord(uint32 addr, uint16* data);
+
+#endif // _FDC_H_
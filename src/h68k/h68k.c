@@ -11,7 +11,18 @@ extern bool h68k_InitVectors();
 extern bool h68k_InitMemoryMap();
 extern void h68k_PrepareMemoryMap();
 extern void h68k_RestoreMemoryMap();
+extern void h68k_ResumeMemoryMap();
 extern void h68k_FatalError(struct h68kFatalDump* dump);
+#if H68K_LATENCY
+#define LATENCY_BUCKETS 64
+#define LATENCY_ROWS    130         // vectors, then bus error and privilege violation emulation
+extern uint32 lat_hist[LATENCY_ROWS][LATENCY_BUCKETS];
+static void h68k_LatencyDump();
+#endif
+#if H68K_STATS
+static void h68k_StatsReset();
+static void h68k_StatsDump();
+#endif
 struct h68kFatalDump h68kFatalDump;
 char h68kFatalDumpMsg[1024];
 
@@ -19,6 +30,7 @@ char h68kFatalDumpMsg[1024];
 void(*h68k_OnResetCpu)();
 void(*h68k_OnResetDevices)();
 void(*h68k_OnFatal)();
+void(*h68k_OnHostCall)(bool enter);
 
 // host registers
 uint16 host_cpu;
@@ -27,13 +39,13 @@ uint8* host_vbr;
 uint32 host_cacr;
 
 // client registers
-uint16 client_cpu;
-uint16 client_sr;
-uint32 client_ssp;
-uint32 client_usp;
-uint32 client_vbr;  // 68010+
-uint32 client_sfc;  // 68010+
-uint32 client_dfc;  // 68010+
+struct h68kVcpu h68k_vcpu __attribute__((aligned(16)));
+
+// polling loop detection
+uint32 idle_threshold;
+uint32 idle_count;
+uint32 idle_pc;
+uint32 idle_addr;
 
 // backed up host control registers
 uint32 old_usp;
@@ -54,15 +66,24 @@ bool h68k_Init()
     h68kFatalDump.err = 0;
     h68kFatalDumpMsg[0] = 0;
 
+    SetMem((uint8*)&h68k_vcpu, 0, VCPU_SIZE);
     client_cpu  = H68K_CPU_68000;
     host_cpu    = H68K_CPU_68030;
     host_ssp    = 0;
     host_vbr    = 0;
+#if H68K_CACHE
+    host_cacr   = H68K_CACR_EI | H68K_CACR_IBE | H68K_CACR_ED | H68K_CACR_DBE | H68K_CACR_WA;
+#else
     host_cacr   = 0x0000;
+#endif
 
     h68k_OnResetCpu = 0;
     h68k_OnResetDevices = 0;
     h68k_OnFatal = 0;
+    h68k_OnHostCall = 0;
+
+    h68k_SetIdleDetect(0);
+    h68k_SetLatencyTimer(0, 0, 0, 0);
 
     // create host stack
     if (host_ssp == 0) {
@@ -101,6 +122,9 @@ void h68k_Run()
     // this has been moved to the top as TOS4 uses shadow registers during interrupts that rely on the MMU being configured
     disableirq();
 
+    // no more gemdos from here on
+    LockMem(true);
+
     // prepare memory map before start
     h68k_PrepareMemoryMap();
 
@@ -117,6 +141,7 @@ void h68k_Run()
     {
         // client coldboot regs
         client_sr   = 0x2000;
+        client_ipl  = 0x0700;
         client_ssp  = 0;
         client_usp  = 0;
         client_vbr  = 0;
@@ -125,6 +150,9 @@ void h68k_Run()
 
         // reset, and start client
         h68kFatalDump.err = 0;
+#if H68K_STATS
+        h68k_StatsReset();
+#endif
         __asm__ volatile ( \
             " jmp _vec68000_Reset\n" \
             : : : "d0", "d1", "d2", "d3", "d4", "d5", "d6", "d7", "a0", "a1", "a2", "a3", "a4", "a5", "a6", "cc", "memory" );
@@ -144,6 +172,14 @@ void h68k_Run()
 
     // restore mmu
     h68k_RestoreMemoryMap();
+    LockMem(false);
+
+#if H68K_LATENCY
+    h68k_LatencyDump();
+#endif
+#if H68K_STATS
+    h68k_StatsDump();
+#endif
 }
 
 //--------------------------------------------------------------------
@@ -157,6 +193,47 @@ void h68k_Terminate()
 }
 
 
+//--------------------------------------------------------------------
+//
+// Run <func> on the host OS, from io handlers and host vectors
+//
+// The host vbr, mmu and cache setup are put back and interrupts are
+// enabled while it runs, so gemdos and the host's drivers can be used.
+// The client is frozen meanwhile. Client memory must not overlap any
+// memory the host uses. The host call callback runs on both sides of it
+// with interrupts off, to hand devices the client reprogrammed back to
+// the host and take them again afterwards.
+//
+//--------------------------------------------------------------------
+void h68k_HostCall(void(*func)(void* user), void* user)
+{
+    uint32 usp;
+    __asm__ volatile (" movec usp,%0\n" : "=a"(usp) : : );
+
+    disableirq();
+    if (h68k_OnHostCall)
+        h68k_OnHostCall(true);
+    h68k_RestoreMemoryMap();
+    __asm__ volatile ( \
+        " move.l _old_vbr,d0\n movec d0,vbr\n" \
+        " move.l _old_cacr,d0\n or.w #0x0808,d0\n movec d0,cacr\n" \
+        " move.w #0x2300,sr\n" \
+        : : : "d0", "cc", "memory" );
+
+    func(user);
+
+    disableirq();
+    __asm__ volatile ( \
+        " move.l _host_vbr,d0\n movec d0,vbr\n" \
+        " move.l _host_cacr,d0\n or.w #0x0808,d0\n movec d0,cacr\n" \
+        " movec %0,usp\n" \
+        : : "a"(usp) : "d0", "cc", "memory" );
+    if (h68k_OnHostCall)
+        h68k_OnHostCall(false);
+    h68k_ResumeMemoryMap();
+}
+
+
 //--------------------------------------------------------------------
 //
 // Fatal error handler
@@ -220,7 +297,217 @@ void h68k_SetFatalCallback(void(*func)(struct h68kFatalDump*))
     h68k_OnFatal = func;
 }
 
+//--------------------------------------------------------------------
+//
+// Set callback for entering (true) and leaving h68k_HostCall
+//
+//--------------------------------------------------------------------
+void h68k_SetHostCallCallback(void(*func)(bool enter))
+{
+    h68k_OnHostCall = func;
+}
+
 
+//--------------------------------------------------------------------
+//
+// Cache configuration while the client runs, only the enable, burst
+// and write allocate bits are used. Burst needs memory that supports
+// it, write allocate keeps the data cache coherent between host and
+// client accesses to the same address.
+//
+//--------------------------------------------------------------------
+void h68k_SetCacheMode(uint32 cacr)
+{
+#if H68K_CACHE
+    host_cacr = cacr & (H68K_CACR_EI | H68K_CACR_IBE | H68K_CACR_ED | H68K_CACR_DBE | H68K_CACR_WA);
+#endif
+}
+
+
+//--------------------------------------------------------------------
+//
+// Park the host cpu when the client keeps polling the same io address
+// from the same instruction. 0 disables the detection.
+//
+//--------------------------------------------------------------------
+void h68k_SetIdleDetect(uint32 threshold)
+{
+    idle_threshold = threshold;
+    idle_count = 0;
+    idle_pc = 0;
+    idle_addr = 0;
+}
+
+
+//--------------------------------------------------------------------
+//
+// Interrupt latency
+//
+// Time spent in the interrupt trampolines, and in bus error and
+// privilege violation emulation where interrupts are held off,
+// is sampled from a free running mfp timer counting down from
+// <period> (0 = 256) at <ns> per tick. Its interrupt on <vec>
+// counts the wraps, for anything longer than a period.
+// Histograms, one tick per bucket, are printed when the vm ends.
+//
+//--------------------------------------------------------------------
+#if H68K_TIMING
+volatile uint8* lat_timer;
+uint16 lat_period;
+uint16 lat_vector;
+uint8  lat_start;
+uint32 lat_wraps;
+uint32 lat_wrap0;
+uint32 lat_ns;
+
+void h68k_SetLatencyTimer(volatile uint8* data, uint8 period, uint32 ns, uint16 vec)
+{
+    lat_timer = data;
+    lat_period = period ? period : 256;
+    lat_vector = vec;
+    lat_ns = ns;
+#if H68K_LATENCY
+    SetMem((uint8*)lat_hist, 0, sizeof(lat_hist));
+#endif
+}
+#endif
+
+#if H68K_LATENCY
+uint32 lat_hist[LATENCY_ROWS][LATENCY_BUCKETS];
+
+static uint32 h68k_LatencyPercentile(uint32* hist, uint32 count, uint32 pct)
+{
+    uint32 limit = (count * pct + 99) / 100;
+    uint32 sum = 0;
+    for (uint32 i=0; i<LATENCY_BUCKETS; i++) {
+        sum += hist[i];
+        if (sum >= limit)
+            return i;
+    }
+    return LATENCY_BUCKETS - 1;
+}
+
+static void h68k_LatencyDump()
+{
+    if (lat_ns == 0)
+        return;
+    h68k_debugPrint("latency (us)   count    min    p50    p99    max");
+    for (uint32 v=0; v<LATENCY_ROWS; v++) {
+        uint32* hist = lat_hist[v];
+        uint32 count = 0;
+        for (uint32 i=0; i<LATENCY_BUCKETS; i++)
+            count += hist[i];
+        if (count == 0)
+            continue;
+        uint32 lo = 0;
+        while (hist[lo] == 0)
+            lo++;
+        uint32 hi = LATENCY_BUCKETS - 1;
+        while (hist[hi] == 0)
+            hi--;
+        char name[12];
+        if (v < 128)
+            sprintf(name, " vec %03x", v << 2);
+        else
+            sprintf(name, "%s", (v == 128) ? " berr   " : " pviol  ");
+        h68k_debugPrint("%s : %8d %6d %6d %6d %6d%s", name, count,
+            (lo * lat_ns) / 1000,
+            (h68k_LatencyPercentile(hist, count, 50) * lat_ns) / 1000,
+            (h68k_LatencyPercentile(hist, count, 99) * lat_ns) / 1000,
+            (hi * lat_ns) / 1000,
+            (hi == LATENCY_BUCKETS - 1) ? "+" : "");
+    }
+}
+#endif
+
+//--------------------------------------------------------------------
+//
+// Hypervisor overhead
+//
+// Ticks spent in bus error and privilege violation emulation and
+// in the exception trampolines, from the same timer as above.
+// Single handlers are mostly shorter than a tick but the sum over
+// many of them is accurate, sampling a free running counter.
+// Optionally latched every <frames> exceptions on <vec>, normally
+// the VBL, and printed as a share of the time those frames take
+// when the vm ends. Only the last STATS_REPORTS are kept.
+//
+//--------------------------------------------------------------------
+#if H68K_STATS
+uint32 stat_table[6];               // ticks berr/pviol/tramp, count berr/pviol/tramp
+uint32 stat_frames;
+uint32 stat_report_frames;
+uint32 stat_frame_us;
+uint32 stat_last[6];
+#define STATS_REPORTS 64
+uint32 stat_report[STATS_REPORTS][6];
+uint32 stat_reports;
+
+static void h68k_StatsReset()
+{
+    SetMem((uint8*)stat_table, 0, sizeof(stat_table));
+    SetMem((uint8*)stat_last, 0, sizeof(stat_last));
+    stat_frames = 0;
+    stat_reports = 0;
+}
+
+void h68k_GetStats(struct h68kStats* stats)
+{
+    stats->frames       = stat_frames;
+    stats->ns_per_tick  = lat_ns;
+    stats->berr_ticks   = stat_table[0];
+    stats->pviol_ticks  = stat_table[1];
+    stats->tramp_ticks  = stat_table[2];
+    stats->berr_count   = stat_table[3];
+    stats->pviol_count  = stat_table[4];
+    stats->tramp_count  = stat_table[5];
+}
+
+static bool h68k_StatsFrame(uint32 vec, uint16* frame)
+{
+    stat_frames++;
+    if ((stat_report_frames == 0) || (stat_frames % stat_report_frames))
+        return false;
+
+    uint32* d = stat_report[stat_reports % STATS_REPORTS];
+    for (uint16 i=0; i<6; i++) {
+        d[i] = stat_table[i] - stat_last[i];
+        stat_last[i] = stat_table[i];
+    }
+    stat_reports++;
+    return false;
+}
+
+static void h68k_StatsDump()
+{
+    if ((stat_reports == 0) || (lat_ns == 0))
+        return;
+    uint32 total = stat_report_frames * ((stat_frame_us * 1000) / lat_ns);
+    if (total == 0)
+        return;
+    uint32 first = (stat_reports > STATS_REPORTS) ? (stat_reports - STATS_REPORTS) : 0;
+    h68k_debugPrint("hv overhead per %d frames, last %d of %d", stat_report_frames, stat_reports - first, stat_reports);
+    for (uint32 r=first; r<stat_reports; r++) {
+        uint32* d = stat_report[r % STATS_REPORTS];
+        uint32 berr = (d[0] * 1000) / total;
+        uint32 pviol = (d[1] * 1000) / total;
+        uint32 tramp = (d[2] * 1000) / total;
+        uint32 all = berr + pviol + tramp;
+        h68k_debugPrint("hv %d.%d%% : berr %d.%d%% (%d) pviol %d.%d%% (%d) tramp %d.%d%% (%d)",
+            all / 10, all % 10,
+            berr / 10, berr % 10, d[3] / stat_report_frames,
+            pviol / 10, pviol % 10, d[4] / stat_report_frames,
+            tramp / 10, tramp % 10, d[5] / stat_report_frames);
+    }
+}
+
+void h68k_SetStatsReport(uint32 vec, uint32 frames, uint32 frame_us)
+{
+    stat_report_frames = frames;
+    stat_frame_us = frame_us;
+    h68k_SetHostVector(vec, h68k_StatsFrame);
+}
+#endif
 
 //--------------------------------------------------------------------
 //
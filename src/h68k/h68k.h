@@ -11,6 +11,14 @@
 #define H68K_PAGESIZE       256
 #define H68K_DEBUGTRACE     0
 #define H68K_DEBUGPRINT     1
+#define H68K_VIRTUALIPL     0       // track client ipl in software, host never goes above H68K_IPLCEILING
+#define H68K_IPLCEILING     5
+#define H68K_LATENCY        0       // interrupt latency histograms, needs a free running mfp timer
+#define H68K_STATS          0       // time spent in hypervisor handlers, same timer
+#define H68K_TIMING         (H68K_LATENCY || H68K_STATS)
+#define H68K_CACHE          0       // client ram cached, executed pages write protected to catch self modifying code (unvalidated)
+#define H68K_ATCPRELOAD     0       // reload hot client pages into the atc after flushing it (unvalidated)
+#define H68K_SHORTTREE      0       // 24bit client tree using the tc initial shift, supervisor 32bit space in ttrs (unvalidated)
 
 #ifndef __asm_inc__
     #include "common.h"
@@ -26,6 +34,21 @@
     typedef void(*h68kIOFW)(uint32 addr, uint16*);
     typedef void(*h68kIOFL)(uint32 addr, uint32*);
 
+    typedef bool(*h68kHostVector)(uint32 vec, uint16* frame);
+
+    struct h68kVcpu                 // client cpu state, 16 byte aligned, see VCPU_ offsets
+    {
+        uint16 sr;                  // only S bit
+        uint16 ipl;                 // ipl bits only (H68K_VIRTUALIPL)
+        uint32 ssp;
+        uint32 usp;
+        uint32 vbr;                 // 68010+
+        uint32 sfc;                 // 68010+
+        uint32 dfc;                 // 68010+
+        uint16 cpu;
+        uint16 pad[3];
+    };
+
     #define extrwh(x)   extern uint8 x(uint32, void*);
     typedef uint8(*h68kRWHandler)(uint32,void*);
 
@@ -54,6 +77,31 @@
         #define h68k_debugPrintTrace()
     #endif
 
+    #if H68K_TIMING
+        void h68k_SetLatencyTimer(volatile uint8* data, uint8 period, uint32 ns, uint16 vec);
+    #else
+        #define h68k_SetLatencyTimer(...)
+    #endif
+
+    #if H68K_STATS
+        struct h68kStats                    // totals since h68k_Run()
+        {
+            uint32 frames;
+            uint32 ns_per_tick;
+            uint32 berr_ticks;              // bus error emulation
+            uint32 pviol_ticks;             // privilege violation emulation
+            uint32 tramp_ticks;             // exception trampolines
+            uint32 berr_count;
+            uint32 pviol_count;
+            uint32 tramp_count;
+        };
+        void h68k_GetStats(struct h68kStats* stats);
+        void h68k_SetStatsReport(uint32 vec, uint32 frames, uint32 frame_us);
+    #else
+        #define h68k_GetStats(...)
+        #define h68k_SetStatsReport(...)
+    #endif
+
     struct h68kFatalDump
     {
         uint32 err; uint32 pc; uint32 sr; uint32 usp;
@@ -67,22 +115,41 @@
     bool    h68k_Init();
     void    h68k_Run();
     void    h68k_Terminate();
+    void    h68k_HostCall(void(*func)(void* user), void* user);                 // run func on the host os (from handlers / host vectors)
     char*   h68k_GetLastError();
 
     void    h68k_SetCpuResetCallback(void(*func)());                            // when cpu is reset
     void    h68k_SetDeviceResetCallback(void(*func)());                         // when executing reset instruction
     void    h68k_SetFatalCallback(void(*func)(struct h68kFatalDump* dump));     // when something terrible has happened
+    void    h68k_SetHostCallCallback(void(*func)(bool enter));                  // around h68k_HostCall, interrupts off
+    void    h68k_SetIdleDetect(uint32 threshold);                               // park host after <threshold> identical io polls (0 = off)
 
     void    h68k_SetVector(uint32 vec, uint32 ipl, void(*func)());
     void    h68k_SetVectorIpl(uint32 vec, uint32 ipl);
     void    h68k_SetVectorHandler(uint32 vec, void(*func)());
+    void    h68k_SetClientVector(uint32 vec, uint32 ipl, void(*func)());        // exception is passed on to the client
+    void    h68k_SetHostVector(uint32 vec, h68kHostVector func);                // exception is handled on the host, return false to pass on to client
+    h68kHostVector h68k_GetHostVector(uint32 vec);                              // current host handler, for chaining (0 if none)
+    void    h68k_ClearHostVector(uint32 vec);                                   // back to the client, safe from within the handler
+    bool    h68k_RaiseInterrupt(uint32 vec, uint32 level);                      // queue virtual client interrupt (from handlers / host vectors)
+
+    bool    h68k_ProfilerStart(uint32 vec, uint32 entries, bool passon);        // sample client pc on every <vec> exception
+    bool    h68k_ProfilerSave(const char* filename);
     void    h68k_SetPrivilegeViolationHandler(uint32 start, uint32 end, void(*fsuper)(), void(*fuser)());
 
     uint32  h68k_GetMmuPageSize();
 
     void    h68k_MapMemory(uint32 start, uint32 end, uint32 dest);              // client space -> host space
+    void    h68k_MapMemoryEx(uint32 start, uint32 end, uint32 dest, uint32 flags); // client space -> host space (H68K_MAP_ flags)
     void    h68k_MapReadOnly(uint32 start, uint32 end, uint32 dest);            // client space -> host space (writes trigger bus error on client)
     void    h68k_RemapPage(uint32 laddr, uint32 paddr);                         // remap page
+    void    h68k_RemapRange(uint32 start, uint32 end, uint32(*func)(uint32 laddr)); // remap pages to func(laddr), flushed once
+    void    h68k_FlushCache();                                                  // after host or dma writes to client ram
+    void    h68k_SetCacheMode(uint32 cacr);                                     // H68K_CACR_ enable, burst and write allocate bits
+    uint32  h68k_GetHostAddress(uint32 laddr);                                  // host address of mapped client memory (0 if not memory)
+    uint32  h68k_CollectDirty(uint32 start, uint32 end, bool all,               // call func for pages written by the client since last call
+                void(*func)(uint32 laddr, uint32 paddr));
+    void    h68k_SetHotPage(uint16 slot, uint32 laddr, bool code);             // H68K_HOT_ slot, preloaded into the atc after flushes
 
     void    h68k_MapFatal(uint32 start, uint32 end);                            // trigger fatal error on host
     void    h68k_MapInvalid(uint32 start, uint32 end);                          // trigger bus error on client
@@ -175,27 +242,85 @@ extrwh(h68k_mmuf_ReadLongFF);       // read constant FFFFFFFF
 #define H68K_CPU_68060          0x0060
 #define H68K_CPU_68080          0x0080
 
+#define H68K_MAP_CACHED         0x00000000      // data cache is write-through on the 030
 #define H68K_MAP_WP             0x00000004
 #define H68K_MAP_CI             0x00000040
 #define H68K_MAP_S              0x00000100
 
+#define H68K_CACR_EI            0x00000001      // 68030 cacr
+#define H68K_CACR_CI            0x00000008
+#define H68K_CACR_IBE           0x00000010
+#define H68K_CACR_ED            0x00000100
+#define H68K_CACR_CD            0x00000800
+#define H68K_CACR_DBE           0x00001000
+#define H68K_CACR_WA            0x00002000
+
+#define H68K_HOT_VECTORS        0               // client pages kept in the atc (H68K_ATCPRELOAD)
+#define H68K_HOT_SYSVARS        1
+#define H68K_HOT_STACK          2               // set on reset
+#define H68K_HOT_CODE           3               // set on reset and code faults
+#define H68K_HOT_VIDEO          4               // application
+#define H68K_HOT_USER           5               // application, up to H68K_HOT_MAX
+#define H68K_HOT_MAX            8
+
 
 //----------------------------------------------------------------
 // variables
 //----------------------------------------------------------------
-extvar(uint16, client_cpu);
-extvar(uint16, client_sr);      // only S bit
-extvar(uint32, client_ssp);
-extvar(uint32, client_usp);
-extvar(uint32, client_vbr);     // 68010+
-extvar(uint32, client_sfc);     // 68010+
-extvar(uint32, client_dfc);     // 68010+
+extvar(struct h68kVcpu, h68k_vcpu);
+
+#define VCPU_SR         0       // hot fields first, all within one cache line
+#define VCPU_IPL        2
+#define VCPU_SSP        4
+#define VCPU_USP        8
+#define VCPU_VBR        12
+#define VCPU_SFC        16
+#define VCPU_DFC        20
+#define VCPU_CPU        24
+#define VCPU_SIZE       32
+
+#ifndef __asm_inc__
+    #define client_cpu  (h68k_vcpu.cpu)
+    #define client_sr   (h68k_vcpu.sr)
+    #define client_ipl  (h68k_vcpu.ipl)
+    #define client_ssp  (h68k_vcpu.ssp)
+    #define client_usp  (h68k_vcpu.usp)
+    #define client_vbr  (h68k_vcpu.vbr)
+    #define client_sfc  (h68k_vcpu.sfc)
+    #define client_dfc  (h68k_vcpu.dfc)
+#else
+    // absolute, for code without a register loaded with the vcpu base
+    #define _client_cpu _h68k_vcpu+VCPU_CPU
+    #define _client_sr  _h68k_vcpu+VCPU_SR
+    #define _client_ipl _h68k_vcpu+VCPU_IPL
+    #define _client_ssp _h68k_vcpu+VCPU_SSP
+    #define _client_usp _h68k_vcpu+VCPU_USP
+    #define _client_vbr _h68k_vcpu+VCPU_VBR
+    #define _client_sfc _h68k_vcpu+VCPU_SFC
+    #define _client_dfc _h68k_vcpu+VCPU_DFC
+#endif
 
 extvar(uint16, host_cpu);
 extvar(uint32, host_ssp);
 extvar(uint8*, host_vbr);
 extvar(uint32, host_cacr);
 
+extvar(uint32, idle_threshold);     // polling loop detection
+extvar(uint32, idle_count);
+extvar(uint32, idle_pc);
+extvar(uint32, idle_addr);
+
+extvar(uint8,  virq_mask);          // virtual interrupts, one bit per pending level
+extvar(uint8,  virq_trace);         // trace armed to deliver them
+extvar(uint16, virq_count);
+
+extvar(volatile uint8*, lat_timer); // timer data register (H68K_TIMING)
+extvar(uint16, lat_period);         // ticks per wrap
+extvar(uint16, lat_vector);         // timer interrupt, counts the wraps
+extvar(uint8,  lat_start);
+extvar(uint32, lat_wraps);
+extvar(uint32, lat_wrap0);
+
 
 
 //----------------------------------------------------------------
@@ -206,13 +331,27 @@ extvar(uint32, host_cacr);
 extfunc(vec68000_Group0);
 extfunc(vec68000_Group1);
 extfunc(vec68000_Group2);
+extfunc(vec68000_Int1);             // interrupts with built in ipl
+extfunc(vec68000_Int2);
+extfunc(vec68000_Int3);
+extfunc(vec68000_Int4);
+extfunc(vec68000_Int5);
+extfunc(vec68000_Int6);
+extfunc(vec68000_Int7);
 
 extfunc(vec68000_Reset);
 extfunc(vec68000_Fatal);
 extfunc(vec68000_DebugTrace);
 extfunc(vec68000_BusError);
 extfunc(vec68000_AddrError);
+extfunc(vec68000_Host);
+extfunc(vec68000_Virq);
+extfunc(vec68000_Trace);
 extfunc(vec68000_PrivilegeViolation);
+extfunc(h68k_IdleStop);
+extfunc(h68k_LatencyRecord);
+extfunc(h68k_LatencyBerr);
+extfunc(h68k_LatencyPviol);
 
 extfunc(pviol68000_PrivilegeViolation);
 extfunc(pviol68000_IllegalInstruction);
@@ -385,6 +524,16 @@ extfunc(pviol68010_rte);
     #define SR_MASK_NS      0x871F
     #define SR_MASK_NI      0x401F
     #define SR_MASK_NC      0xA700
+    #define SR_MASK_NSI     0x801F
+
+    //----------------------------------------------------------------------------------------------
+    // (H68K_VIRTUALIPL) clamp ipl in <r> to what the host is allowed to run at
+    //----------------------------------------------------------------------------------------------
+    #define HOST_IPL(r) \
+        cmp.w   #(H68K_IPLCEILING<<8),r; \
+        bls.b   9f; \
+        move.w  #(H68K_IPLCEILING<<8),r; \
+    9:
 
 #if H68K_DEBUGPRINT
     #define H68K_PRINTVALUE(_id,_val) \
@@ -396,6 +545,20 @@ extfunc(pviol68010_rte);
     #define H68K_PRINTVALUE(_id,_val)
 #endif
 
+    //----------------------------------------------------------------------------------------------
+    // (H68K_TIMING) timestamp, and record time since timestamp for handler path _p (Berr, Pviol)
+    //----------------------------------------------------------------------------------------------
+#if H68K_TIMING
+    #define LATENCY_BEGIN \
+        move.b  ([_lat_timer]),_lat_start; \
+        move.l  _lat_wraps,_lat_wrap0;
+    #define LATENCY_END(_p) \
+        jsr     _h68k_Latency##_p;
+#else
+    #define LATENCY_BEGIN
+    #define LATENCY_END(_p)
+#endif
+
     #define H68K_FATAL(_id) \
         move.l  #0xdeadbadd,-(sp); \
         move.l  _id,-(sp); \
@@ -409,6 +572,7 @@ extfunc(pviol68010_rte);
     //     0xdeadbe05 : berr   : (unimplemented) rmw
     //     0xdeadbe06 : berr   : invalid callback
     //     0xdeadbeff : berr   : fatal error access handler
+    //     0xdeadad01 : addr   : address error in host code
 
 #endif
 
@@ -47,9 +47,19 @@
 //
 //--------------------------------------------------------------------
 //
-// todo:
-//  - we may want to reuse any existing mmu table for supervisor
-//    instead of creating our own. Even though we make a standard one.
+// (H68K_CACHE) Function code lookup is enabled and user program
+// fetches get a tree of their own, mirroring the data tree except
+// for plain ram pages:
+//
+//  * Ram, not executed from
+//      Invalid in the program tree. The first fetch validates it there
+//      and write protects the page in the data tree instead.
+//
+//  * Ram, executed from
+//      A write flushes the instruction cache, unprotects the page and
+//      invalidates it in the program tree again. Pages that keep
+//      flipping mix code and data, they are left valid and cache
+//      inhibited in the program tree.
 //
 //--------------------------------------------------------------------
 #include "h68k.h"
@@ -69,18 +79,37 @@ typedef struct
 #define MMU_SHORT_TABLE     0x00000002UL
 #define MMU_LONG_TABLE      0x00000003UL
 #define MMU_WP              0x00000004UL
+#define MMU_M               0x00000010UL
 #define MMU_CI              0x00000040UL
 #define MMU_S               0x00000100UL
 #define MMU_DT              0x00000003UL
+#define MMU_ATC_ENTRIES     22
 
 MMURegs h68k_mmu_old;
 MMURegs h68k_mmu;
 uint32* h68k_mmu_table;
 uint16  h68k_mmu_pagesize;
+#if H68K_ATCPRELOAD
+bool    h68k_mmu_running;                   // client tree is live
+uint32  h68k_mmu_hot[H68K_HOT_MAX];         // laddr | fc, 0 for unused slots
+#endif
+#if H68K_CACHE
+uint32* h68k_mmu_ptable;                    // user program tree
+uint8*  h68k_mmu_code;                      // code tracking state per page
+
+#define CODE_NONE           0x00            // not tracked, program view mirrors data view
+#define CODE_DATA           0x01            // ram, not executed from since last write
+#define CODE_EXEC           0x02            // executed from, write protected
+#define CODE_MIXED          0x03            // code and data in same page, fetches cache inhibited
+#define CODE_STATE          0x03
+#define CODE_FLIP           0x04            // exec -> data flips counted in upper bits
+#define CODE_FLIPMAX        (8 * CODE_FLIP)
+#endif
 
 uint32 h68k_GetMmuPageSize();
 void h68k_PrepareMemoryMap();
 void h68k_RestoreMemoryMap();
+void h68k_ResumeMemoryMap();
 void h68k_GetMMU(MMURegs* regs);
 void h68k_SetMMU(MMURegs* regs);
 
@@ -89,6 +118,13 @@ void LongDescriptor(uint32* table, uint32 idx, uint32 addr, uint32 flag);
 void ShortInvalidDescriptor(uint32* table, uint32 idx, uint32 userdata);
 void LongInvalidDescriptor(uint32* table, uint32 idx, uint32 userdata, uint32 userdata2);
 void h68k_PrepareFtables();
+#if H68K_CACHE
+void h68k_PrepareCodePages();
+#endif
+#if H68K_ATCPRELOAD
+void h68k_PreloadAtc();
+void h68k_PreloadAtcClient(uint32 ssp, uint32 pc);
+#endif
 
 void h68k_MapAddressRangeEx(uint32 start, uint32 end, uint32 dest, uint32 flag);
 void h68k_MapAccessHandlerEx(uint32 start, uint32 end, uint32 userdata, h68kRWHandler readByte, h68kRWHandler writeByte,
@@ -96,6 +132,103 @@ void h68k_MapAccessHandlerEx(uint32 start, uint32 end, uint32 userdata, h68kRWHa
     h68kRWHandler readThree, h68kRWHandler writeThree, h68kRWHandler readModifyWrite);
 
 
+//--------------------------------------------------------------------
+// supervisor table
+//
+// A standard Falcon/TT setup, ram and rom cacheable, io and everything
+// above the 030 address range inhibited. Returns the root table.
+//--------------------------------------------------------------------
+static uint32* h68k_CreateSupervisorTable()
+{
+    const uint32 tbl_size = 4 * 16;
+    uint32* tia0s = (uint32*) AllocMem(tbl_size * 4, 16);
+    uint32* tib0s = (uint32*) (tbl_size + (uint32)tia0s);
+    uint32* tib1s = (uint32*) (tbl_size + (uint32)tib0s);
+    uint32* tic0s = (uint32*) (tbl_size + (uint32)tib1s);
+
+#if H68K_CACHE
+    const uint32 ram_ci = 0;
+#else
+    const uint32 ram_ci = MMU_CI;
+#endif
+    ShortDescriptor(tia0s,  0, (uint32)tib0s,MMU_SHORT_TABLE);
+    ShortDescriptor(tia0s,  1, 0x10000000,   MMU_PAGE | MMU_CI);
+    ShortDescriptor(tia0s,  2, 0x20000000,   MMU_PAGE | MMU_CI);
+    ShortDescriptor(tia0s,  3, 0x30000000,   MMU_PAGE | MMU_CI);
+    ShortDescriptor(tia0s,  4, 0x40000000,   MMU_PAGE | MMU_CI);
+    ShortDescriptor(tia0s,  5, 0x50000000,   MMU_PAGE | MMU_CI);
+    ShortDescriptor(tia0s,  6, 0x60000000,   MMU_PAGE | MMU_CI);
+    ShortDescriptor(tia0s,  7, 0x70000000,   MMU_PAGE | MMU_CI);
+    ShortDescriptor(tia0s,  8, 0x80000000,   MMU_PAGE | MMU_CI);
+    ShortDescriptor(tia0s,  9, 0x90000000,   MMU_PAGE | MMU_CI);
+    ShortDescriptor(tia0s, 10, 0xA0000000,   MMU_PAGE | MMU_CI);
+    ShortDescriptor(tia0s, 11, 0xB0000000,   MMU_PAGE | MMU_CI);
+    ShortDescriptor(tia0s, 12, 0xC0000000,   MMU_PAGE | MMU_CI);
+    ShortDescriptor(tia0s, 13, 0xD0000000,   MMU_PAGE | MMU_CI);
+    ShortDescriptor(tia0s, 14, 0xE0000000,   MMU_PAGE | MMU_CI);
+    ShortDescriptor(tia0s, 15, (uint32)tib1s,MMU_SHORT_TABLE);
+
+    ShortDescriptor(tib0s,  0, (uint32)tic0s,MMU_SHORT_TABLE);
+    ShortDescriptor(tib0s,  1, 0x01000000,   MMU_PAGE | ram_ci);
+    ShortDescriptor(tib0s,  2, 0x02000000,   MMU_PAGE | ram_ci);
+    ShortDescriptor(tib0s,  3, 0x03000000,   MMU_PAGE | ram_ci);
+    ShortDescriptor(tib0s,  4, 0x04000000,   MMU_PAGE | ram_ci);
+    ShortDescriptor(tib0s,  5, 0x05000000,   MMU_PAGE | ram_ci);
+    ShortDescriptor(tib0s,  6, 0x06000000,   MMU_PAGE | ram_ci);
+    ShortDescriptor(tib0s,  7, 0x07000000,   MMU_PAGE | ram_ci);
+    ShortDescriptor(tib0s,  8, 0x08000000,   MMU_PAGE | ram_ci);
+    ShortDescriptor(tib0s,  9, 0x09000000,   MMU_PAGE | ram_ci);
+    ShortDescriptor(tib0s, 10, 0x0A000000,   MMU_PAGE | ram_ci);
+    ShortDescriptor(tib0s, 11, 0x0B000000,   MMU_PAGE | ram_ci);
+    ShortDescriptor(tib0s, 12, 0x0C000000,   MMU_PAGE | ram_ci);
+    ShortDescriptor(tib0s, 13, 0x0D000000,   MMU_PAGE | ram_ci);
+    ShortDescriptor(tib0s, 14, 0x0E000000,   MMU_PAGE | ram_ci);
+    ShortDescriptor(tib0s, 15, 0x0F000000,   MMU_PAGE | ram_ci);
+
+    ShortDescriptor(tib1s,  0, 0xF0000000,   MMU_PAGE | MMU_CI);
+    ShortDescriptor(tib1s,  1, 0xF1000000,   MMU_PAGE | MMU_CI);
+    ShortDescriptor(tib1s,  2, 0xF2000000,   MMU_PAGE | MMU_CI);
+    ShortDescriptor(tib1s,  3, 0xF3000000,   MMU_PAGE | MMU_CI);
+    ShortDescriptor(tib1s,  4, 0xF4000000,   MMU_PAGE | MMU_CI);
+    ShortDescriptor(tib1s,  5, 0xF5000000,   MMU_PAGE | MMU_CI);
+    ShortDescriptor(tib1s,  6, 0xF6000000,   MMU_PAGE | MMU_CI);
+    ShortDescriptor(tib1s,  7, 0xF7000000,   MMU_PAGE | MMU_CI);
+    ShortDescriptor(tib1s,  8, 0xF8000000,   MMU_PAGE | MMU_CI);
+    ShortDescriptor(tib1s,  9, 0xF9000000,   MMU_PAGE | MMU_CI);
+    ShortDescriptor(tib1s, 10, 0xFA000000,   MMU_PAGE | MMU_CI);
+    ShortDescriptor(tib1s, 11, 0xFB000000,   MMU_PAGE | MMU_CI);
+    ShortDescriptor(tib1s, 12, 0xFC000000,   MMU_PAGE | MMU_CI);
+    ShortDescriptor(tib1s, 13, 0xFD000000,   MMU_PAGE | MMU_CI);
+    ShortDescriptor(tib1s, 14, 0xFE000000,   MMU_PAGE | MMU_CI);
+    ShortDescriptor(tib1s, 15, (uint32)tic0s,MMU_SHORT_TABLE);
+
+    ShortDescriptor(tic0s,  0, 0x00000000,   MMU_PAGE | ram_ci);
+    ShortDescriptor(tic0s,  1, 0x00100000,   MMU_PAGE | ram_ci);
+    ShortDescriptor(tic0s,  2, 0x00200000,   MMU_PAGE | ram_ci);
+    ShortDescriptor(tic0s,  3, 0x00300000,   MMU_PAGE | ram_ci);
+    ShortDescriptor(tic0s,  4, 0x00400000,   MMU_PAGE | ram_ci);
+    ShortDescriptor(tic0s,  5, 0x00500000,   MMU_PAGE | ram_ci);
+    ShortDescriptor(tic0s,  6, 0x00600000,   MMU_PAGE | ram_ci);
+    ShortDescriptor(tic0s,  7, 0x00700000,   MMU_PAGE | ram_ci);
+    ShortDescriptor(tic0s,  8, 0x00800000,   MMU_PAGE | ram_ci);
+    ShortDescriptor(tic0s,  9, 0x00900000,   MMU_PAGE | ram_ci);
+    ShortDescriptor(tic0s, 10, 0x00A00000,   MMU_PAGE | ram_ci);
+    ShortDescriptor(tic0s, 11, 0x00B00000,   MMU_PAGE | ram_ci);
+    ShortDescriptor(tic0s, 12, 0x00C00000,   MMU_PAGE | ram_ci);
+    ShortDescriptor(tic0s, 13, 0x00D00000,   MMU_PAGE | ram_ci);
+    ShortDescriptor(tic0s, 14, 0x00E00000,   MMU_PAGE | ram_ci);
+    ShortDescriptor(tic0s, 15, 0x00F00000,   MMU_PAGE | MMU_CI);
+
+#if H68K_SHORTTREE
+    // 32bit ranges are in the ttrs, what is left is the 24bit space
+    // which the 1MB entries above already cover
+    return tic0s;
+#else
+    return tia0s;
+#endif
+}
+
+
 //--------------------------------------------------------------------
 // Init and Restore
 //--------------------------------------------------------------------
@@ -128,105 +261,76 @@ bool h68k_InitMemoryMap(uint32 pagesize)
 	DPRINT("Initializing MMU with pagesize %d", pagesize);
     ASSERT(tid_bits, "Invalid pagesize %d", pagesize);
 
+#if H68K_SHORTTREE
+    // initial shift drops the upper byte: 1MB at the top level, pages below
+	const uint32 is_bits  = 8;
+	const uint32 tia_bits = 4;
+	const uint32 tib_bits = tid_bits;
+	const uint32 tic_bits = 0;
+	const uint32 ps_bits = 32 - is_bits - tia_bits - tib_bits;
+	const uint32 tc_tid  = 0;
+#else
 	const uint32 tic_bits = 4;
 	const uint32 tib_bits = 4;
 	const uint32 tia_bits = 4;
 	const uint32 is_bits  = 0;
 	const uint32 ps_bits = 32 - is_bits - tia_bits - tib_bits - tic_bits - tid_bits;
+	const uint32 tc_tid  = tid_bits;
+#endif
 
-	const uint32 tia_count = 1 + 1;
-	const uint32 tib_count = 2 + 1;
-	const uint32 tic_count = 1 + 1;
-	const uint32 tid_count = 0 + 16;
-
-    const uint32 tia_size = 4 * (1 << tia_bits);    // short descriptors
-    const uint32 tib_size = 4 * (1 << tib_bits);    // short descriptors
-    const uint32 tic_size = 4 * (1 << tic_bits);    // short descriptors
+    const uint32 tbl_size = 4 * 16;                 // short descriptors, upper levels
     const uint32 tid_size = 8 * (1 << tid_bits);    // long descriptors
+    const uint32 tid_count = 16;
 
-    const uint32 size = (tia_size * tia_count) + (tib_size * tib_count) + (tic_size * tic_count) + (tid_size * tid_count);
+	h68k_mmu.tc =       (ps_bits  << 20) |
+			            (is_bits  << 16) |
+			            (tia_bits << 12) |
+			            (tib_bits <<  8) |
+			            (tic_bits <<  4) |
+			            (tc_tid   <<  0)
+                        | 0x02000000            // using srp
+			            | 0x80000000;           // enabled
 
-	uint32* tia0s = (uint32*) AllocMem(size, 4096);
-    uint32* tib0s = (uint32*) (tia_size + (uint32)tia0s);
-    uint32* tib1s = (uint32*) (tib_size + (uint32)tib0s);
-    uint32* tic0s = (uint32*) (tib_size + (uint32)tib1s);
-    uint32* tia0u = (uint32*) (tic_size + (uint32)tic0s);
-    uint32* tib0u = (uint32*) (tia_size + (uint32)tia0u);
-    uint32* tic0u = (uint32*) (tib_size + (uint32)tib0u);
-    uint32* tid0u = (uint32*) (tic_size + (uint32)tic0u);
+    // user tree, tid tables first for alignment
+    const uint32 size = (tid_size * tid_count) + (tbl_size * 3);
+    uint32* tid0u = (uint32*) AllocMem(size, 4096);
+    uint32* tia0u = (uint32*) ((tid_size * tid_count) + (uint32)tid0u);
+    uint32* tib0u = (uint32*) (tbl_size + (uint32)tia0u);
+    uint32* tic0u = (uint32*) (tbl_size + (uint32)tib0u);
 
     h68k_mmu_table      = tid0u;
     h68k_mmu_pagesize   = pagesize;
 
-    // create supervisor table
-    ShortDescriptor(tia0s,  0, (uint32)tib0s,MMU_SHORT_TABLE);
-    ShortDescriptor(tia0s,  1, 0x10000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tia0s,  2, 0x20000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tia0s,  3, 0x30000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tia0s,  4, 0x40000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tia0s,  5, 0x50000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tia0s,  6, 0x60000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tia0s,  7, 0x70000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tia0s,  8, 0x80000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tia0s,  9, 0x90000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tia0s, 10, 0xA0000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tia0s, 11, 0xB0000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tia0s, 12, 0xC0000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tia0s, 13, 0xD0000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tia0s, 14, 0xE0000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tia0s, 15, (uint32)tib1s,MMU_SHORT_TABLE);
+#if H68K_CACHE
+    // user program tree and function code tables
+    const uint32 psize = (tid_size * tid_count) + (tbl_size * 3) + (2 * 32);
+    uint32* tid0p = (uint32*) AllocMem(psize, 4096);
+    uint32* tia0p = (uint32*) ((tid_size * tid_count) + (uint32)tid0p);
+    uint32* tib0p = (uint32*) (tbl_size + (uint32)tia0p);
+    uint32* tic0p = (uint32*) (tbl_size + (uint32)tib0p);
+    uint32* fc0s  = (uint32*) (tbl_size + (uint32)tic0p);
+    uint32* fc0u  = (uint32*) (32 + (uint32)fc0s);
 
-    ShortDescriptor(tib0s,  0, (uint32)tic0s,MMU_SHORT_TABLE);
-    ShortDescriptor(tib0s,  1, 0x01000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tib0s,  2, 0x02000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tib0s,  3, 0x03000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tib0s,  4, 0x04000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tib0s,  5, 0x05000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tib0s,  6, 0x06000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tib0s,  7, 0x07000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tib0s,  8, 0x08000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tib0s,  9, 0x09000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tib0s, 10, 0x0A000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tib0s, 11, 0x0B000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tib0s, 12, 0x0C000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tib0s, 13, 0x0D000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tib0s, 14, 0x0E000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tib0s, 15, 0x0F000000,   MMU_PAGE | MMU_CI);
+    h68k_mmu_ptable     = tid0p;
+    h68k_mmu_code       = (uint8*) AllocMem(0x01000000 / pagesize, 4);
+#endif
 
-    ShortDescriptor(tib1s,  0, 0xF0000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tib1s,  1, 0xF1000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tib1s,  2, 0xF2000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tib1s,  3, 0xF3000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tib1s,  4, 0xF4000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tib1s,  5, 0xF5000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tib1s,  6, 0xF6000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tib1s,  7, 0xF7000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tib1s,  8, 0xF8000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tib1s,  9, 0xF9000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tib1s, 10, 0xFA000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tib1s, 11, 0xFB000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tib1s, 12, 0xFC000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tib1s, 13, 0xFD000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tib1s, 14, 0xFE000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tib1s, 15, (uint32)tic0s,MMU_SHORT_TABLE);
+    // supervisor tree
+    uint32* roots = h68k_CreateSupervisorTable();
 
-    ShortDescriptor(tic0s,  0, 0x00000000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tic0s,  1, 0x00100000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tic0s,  2, 0x00200000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tic0s,  3, 0x00300000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tic0s,  4, 0x00400000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tic0s,  5, 0x00500000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tic0s,  6, 0x00600000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tic0s,  7, 0x00700000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tic0s,  8, 0x00800000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tic0s,  9, 0x00900000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tic0s, 10, 0x00A00000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tic0s, 11, 0x00B00000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tic0s, 12, 0x00C00000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tic0s, 13, 0x00D00000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tic0s, 14, 0x00E00000,   MMU_PAGE | MMU_CI);
-    ShortDescriptor(tic0s, 15, 0x00F00000,   MMU_PAGE | MMU_CI);
 
+#if H68K_SHORTTREE
+    // create usermode table
+    for (int i=0; i<16; i++) {
+        ShortDescriptor(tia0u, i, ((i * tid_size) + (uint32)tid0u), MMU_LONG_TABLE);
+    }
+#if H68K_CACHE
+    // create user program table
+    for (int i=0; i<16; i++) {
+        ShortDescriptor(tia0p, i, ((i * tid_size) + (uint32)tid0p), MMU_LONG_TABLE);
+    }
+#endif
+#else
     // create usermode table
     for (int i=0; i<16; i++) {
         ShortDescriptor(tia0u, i, (uint32)tib0u, MMU_SHORT_TABLE);
@@ -238,13 +342,36 @@ bool h68k_InitMemoryMap(uint32 pagesize)
         ShortDescriptor(tic0u, i, ((i * tid_size) + (uint32)tid0u), MMU_LONG_TABLE);
     }
 
+#if H68K_CACHE
+    // create user program table
+    for (int i=0; i<16; i++) {
+        ShortDescriptor(tia0p, i, (uint32)tib0p, MMU_SHORT_TABLE);
+    }
+    for (int i=0; i<16; i++) {
+        ShortDescriptor(tib0p, i, (uint32)tic0p, MMU_SHORT_TABLE);
+    }
+    for (int i=0; i<16; i++) {
+        ShortDescriptor(tic0p, i, ((i * tid_size) + (uint32)tid0p), MMU_LONG_TABLE);
+    }
+#endif
+#endif
+
+#if H68K_CACHE
+    // function code tables, only user program differs
+    for (int i=0; i<8; i++) {
+        ShortDescriptor(fc0s, i, (uint32)roots, MMU_SHORT_TABLE);
+        ShortDescriptor(fc0u, i, (i == 2) ? (uint32)tia0p : (uint32)tia0u, MMU_SHORT_TABLE);
+    }
+#endif
+
     // default map entire client space to fatal error
     h68k_MapFatal(0x00000000, 0x01000000);
 
     // init MMU registers
 
     // transparently translate 32bit ranges in supervisor mode
-    // (not strictly needed but avoids unnecessary table lookups)
+    // (avoids unnecessary table lookups, and with H68K_SHORTTREE the
+    // srp tree only sees 24bit addresses so they are the only mapping)
 
     // TT0/1 : llllllll pppppppp a....bcd .eee.fff
     //  l = logical address base
@@ -256,23 +383,30 @@ bool h68k_InitMemoryMap(uint32 pagesize)
     //  e = fc base
     //  f = fc mask
     
+#if H68K_CACHE
+	h68k_mmu.ttr0 = 0x017E8173;	// 0x01000000-0x7FFFFFFF
+#else
 	h68k_mmu.ttr0 = 0x017E8573;	// 0x01000000-0x7FFFFFFF CI
+#endif
 	h68k_mmu.ttr1 = 0x807E8573;	// 0x08000000-0xFEFFFFFF CI
     // supervisor root
 	h68k_mmu.srp[0] = 0x80000002;       // enabled
-	h68k_mmu.srp[1] = (uint32)tia0s;    // rootpointer = tia0s
+#if H68K_CACHE
+	h68k_mmu.srp[1] = (uint32)fc0s;     // rootpointer = fc0s
+#else
+	h68k_mmu.srp[1] = (uint32)roots;    // rootpointer = supervisor table
+#endif
     // usermode root
 	h68k_mmu.crp[0] = 0x80000002;       // enabled
+#if H68K_CACHE
+	h68k_mmu.crp[1] = (uint32)fc0u;     // rootpointer = fc0u
+#else
 	h68k_mmu.crp[1] = (uint32)tia0u;    // rootpointer = tia0u
+#endif
     // and the main settings
-	h68k_mmu.tc     =	(ps_bits  << 20) |
-			            (is_bits  << 16) |
-			            (tia_bits << 12) |
-			            (tib_bits <<  8) |
-			            (tic_bits <<  4) |
-			            (tid_bits <<  0)
-                        | 0x02000000            // using srp
-			            | 0x80000000;           // enabled
+#if H68K_CACHE
+    h68k_mmu.tc |= 0x01000000;                  // function code lookup
+#endif
 
 	DPRINT(" tc    = %08x", h68k_mmu.tc);
 	DPRINT(" crp   = %08x %08x", h68k_mmu.crp[0], h68k_mmu.crp[1]);
@@ -282,6 +416,9 @@ bool h68k_InitMemoryMap(uint32 pagesize)
 	DPRINT(" tib0u = %08x", (uint32)tib0u);
 	DPRINT(" tic0u = %08x", (uint32)tic0u);
 	DPRINT(" tid0u = %08x", (uint32)tid0u);
+#if H68K_CACHE
+	DPRINT(" tid0p = %08x", (uint32)tid0p);
+#endif
 	return true;
 }
 
@@ -289,14 +426,36 @@ bool h68k_InitMemoryMap(uint32 pagesize)
 void h68k_PrepareMemoryMap()
 {
     h68k_PrepareFtables();
+#if H68K_CACHE
+    h68k_PrepareCodePages();
+#endif
+#if H68K_ATCPRELOAD
+    h68k_SetHotPage(H68K_HOT_VECTORS, 0x000, false);
+    h68k_SetHotPage(H68K_HOT_SYSVARS, 0x400, false);
+    h68k_mmu_running = true;
+#endif
 }
 
 //--------------------------------------------------------------------
 void h68k_RestoreMemoryMap()
 {
+#if H68K_ATCPRELOAD
+    h68k_mmu_running = false;
+#endif
     h68k_SetMMU(&h68k_mmu_old);
 }
 
+//--------------------------------------------------------------------
+// back to the client map after h68k_HostCall()
+void h68k_ResumeMemoryMap()
+{
+    h68k_SetMMU(&h68k_mmu);
+#if H68K_ATCPRELOAD
+    h68k_mmu_running = true;
+    h68k_PreloadAtc();
+#endif
+}
+
 //--------------------------------------------------------------------
 uint32 h68k_GetMmuPageSize()
 {
@@ -367,12 +526,20 @@ void h68k_SetMMU(MMURegs* regs)
 // public helper functions
 //--------------------------------------------------------------------
 
+void h68k_MapMemoryEx(uint32 start, uint32 end, uint32 dest, uint32 flags) {
+    flags &= (H68K_MAP_WP | H68K_MAP_CI);
+#if !H68K_CACHE
+    flags |= MMU_CI;
+#endif
+    h68k_MapAddressRangeEx(start, end, dest, MMU_PAGE | flags);
+}
+
 void h68k_MapMemory(uint32 start, uint32 end, uint32 dest) {
-    h68k_MapAddressRangeEx(start, end, dest, MMU_PAGE | MMU_CI);
+    h68k_MapMemoryEx(start, end, dest, H68K_MAP_CACHED);
 }
 
 void h68k_MapReadOnly(uint32 start, uint32 end, uint32 dest) {
-    h68k_MapAddressRangeEx(start, end, dest, MMU_PAGE | MMU_CI | MMU_WP);
+    h68k_MapMemoryEx(start, end, dest, H68K_MAP_CACHED | H68K_MAP_WP);
 }
 
 void h68k_MapInvalid(uint32 start, uint32 end) {
@@ -467,8 +634,9 @@ struct h68kFtable* h68k_GetExpandedFtable(uint32 addr)
     newftable[0].writeB = (h68kIOFB)((uint32)oldftable->writeB | 0x80000000);
     newftable[0].writeW = (h68kIOFW)((uint32)oldftable->writeW | 0x80000000);
     newftable[0].writeL = (h68kIOFL)((uint32)oldftable->writeL | 0x80000000);
-    for (uint16 i=1; i<h68k_mmu_pagesize; i++) {
-        CopyMem((uint8*)&newftable[i], (uint8*)&newftable[0], sizeof(struct h68kFtable));
+    for (uint32 i=1; i<h68k_mmu_pagesize; i<<=1) {            // replicate entry 0, doubling each time
+        uint32 n = ((i << 1) > h68k_mmu_pagesize) ? (h68k_mmu_pagesize - i) : i;
+        CopyMem((uint8*)&newftable[i], (uint8*)&newftable[0], n * sizeof(struct h68kFtable));
     }
 
     atc[0] = (uint32)newftable;
@@ -620,32 +788,277 @@ void h68k_MapAddressRangeEx(uint32 start, uint32 end, uint32 dest, uint32 flag)
     DPRINT("Map: [%02x] 0x%08x-0x%08x -> 0x%08x", flag, start, end, dest);
     while (start < end) {
         LongDescriptor(h68k_mmu_table, i, dest, flag);
+#if H68K_CACHE
+        h68k_mmu_code[i] = CODE_NONE;
+#endif
         i += 1; start += h68k_mmu_pagesize; dest += h68k_mmu_pagesize;
     }
 }
 
 //--------------------------------------------------------------------
-// remap a page, safe to call when client is running
+// atc preload
+//
+// A flushed atc costs a table walk on each of the next 22 pages the
+// client touches. Walk the ones it is known to use right away instead:
+// exception vectors, system variables, stack, code and whatever the
+// application adds, like the screen.
 //--------------------------------------------------------------------
-void h68k_RemapPage(uint32 laddr, uint32 paddr)
+#if H68K_ATCPRELOAD
+void h68k_SetHotPage(uint16 slot, uint32 laddr, bool code)
+{
+    if (slot < H68K_HOT_MAX)
+        h68k_mmu_hot[slot] = (laddr & 0x00FFFFFF & ~(h68k_mmu_pagesize - 1)) | (code ? 2 : 1);
+}
+
+void h68k_PreloadAtc()
+{
+    if (!h68k_mmu_running)
+        return;
+    for (uint16 i=0; i<H68K_HOT_MAX; i++) {
+        uint32 hot = h68k_mmu_hot[i];
+        if (hot & 2) {
+            __asm__ volatile (			    \
+                "\n ploadr #2,(%0)"	    \
+                : : "a"(hot & ~3) : "cc"    \
+            );
+        } else if (hot & 1) {
+            __asm__ volatile (			    \
+                "\n ploadr #1,(%0)"	    \
+                : : "a"(hot & ~3) : "cc"    \
+            );
+        }
+    }
+}
+
+// reset: client stack and entry point are known
+void h68k_PreloadAtcClient(uint32 ssp, uint32 pc)
+{
+    h68k_SetHotPage(H68K_HOT_STACK, ssp - 4, false);
+    h68k_SetHotPage(H68K_HOT_CODE, pc, true);
+    h68k_PreloadAtc();
+}
+#else
+void h68k_SetHotPage(uint16 slot, uint32 laddr, bool code) { }
+#define h68k_PreloadAtc()
+#endif
+
+//--------------------------------------------------------------------
+// flush atc / caches, keeping the caches enabled
+//--------------------------------------------------------------------
+static inline void h68k_FlushAtc()
+{
+    __asm__ volatile (			    \
+        "\n pflusha"			    \
+        "\n nop"			        \
+        : : : "cc", "memory"        \
+    );
+    h68k_PreloadAtc();
+}
+
+void h68k_FlushCache()
+{
+    __asm__ volatile (			    \
+        "\n movec cacr,d0"          \
+        "\n or.w #0x0808,d0"        \
+        "\n movec d0,cacr"          \
+        : : : "d0", "cc", "memory"  \
+    );
+}
+
+//--------------------------------------------------------------------
+// flush client (user fc) atc entries only, the host keeps its own
+//--------------------------------------------------------------------
+static inline void h68k_FlushAtcUser()
+{
+    __asm__ volatile (			    \
+        "\n pflush #0,#4"		    \
+        "\n nop"			        \
+        : : : "cc", "memory"        \
+    );
+}
+
+static inline void h68k_FlushAtcUserPage(uint32 laddr)
+{
+    __asm__ volatile (			    \
+        "\n pflush #0,#4,(%0)"	    \
+        "\n nop"			        \
+        : : "a"(laddr) : "cc", "memory" \
+    );
+}
+
+static bool h68k_SetPageAddress(uint32 laddr, uint32 paddr)
 {
     uint32 i = laddr / h68k_mmu_pagesize;
     uint32* atc = &h68k_mmu_table[i<<1];
-    if ((atc[0] & 3) != 0)
+    if ((atc[0] & 3) == 0)
+        return false;
+    atc[1] = (atc[1] & 7) | (paddr & 0xFFFFFFF8);
+#if H68K_CACHE
+    uint32* ptc = &h68k_mmu_ptable[i<<1];
+    if ((ptc[0] & 3) != 0)
+        ptc[1] = atc[1];
+#endif
+    return true;
+}
+
+//--------------------------------------------------------------------
+// remap a page, safe to call when client is running
+//--------------------------------------------------------------------
+void h68k_RemapPage(uint32 laddr, uint32 paddr)
+{
+    if (h68k_SetPageAddress(laddr, paddr))
     {
-        atc[1] = (atc[1] & 7) | (paddr & 0xFFFFFFF8);
-        __asm__ volatile (			\
-            "\n pflusha"			\
-            "\n nop"			    \
-            "\n move.l d0,-(sp)"    \
-            "\n move.l #0x0808,d0"  \
-            "\n movec d0,cacr"      \
-            "\n move.l (sp)+,d0"    \
-            "\n nop"                \
-            : : : "cc", "memory"    \
-        );      
+        h68k_FlushAtcUserPage(laddr);
+        h68k_FlushCache();
+        h68k_PreloadAtc();
+    }
+}
+
+//--------------------------------------------------------------------
+// remap every page in range to func(laddr), with a single flush
+// at the end. safe to call when client is running
+//--------------------------------------------------------------------
+void h68k_RemapRange(uint32 start, uint32 end, uint32(*func)(uint32 laddr))
+{
+    uint32 mask = h68k_mmu_pagesize - 1;
+    uint32 count = 0;
+    start &= ~mask;
+    for (uint32 laddr = start; laddr < end; laddr += h68k_mmu_pagesize) {
+        if (h68k_SetPageAddress(laddr, func(laddr)))
+            count++;
     }
+    if (count == 0)
+        return;
+
+    // per page flush while that is fewer instructions than the atc has entries
+    if (((end - start) / h68k_mmu_pagesize) <= MMU_ATC_ENTRIES) {
+        for (uint32 laddr = start; laddr < end; laddr += h68k_mmu_pagesize)
+            h68k_FlushAtcUserPage(laddr);
+    } else {
+        h68k_FlushAtcUser();
+    }
+    h68k_FlushCache();
+    h68k_PreloadAtc();
+}
+
+//--------------------------------------------------------------------
+// host address of mapped client memory, 0 if not plain memory
+//--------------------------------------------------------------------
+uint32 h68k_GetHostAddress(uint32 laddr)
+{
+    uint32 mask = h68k_mmu_pagesize - 1;
+    uint32* atc = h68k_GetMmuDescriptor(laddr & 0x00FFFFFF);
+    if ((atc[0] & MMU_DT) != MMU_PAGE)
+        return 0;
+    return (atc[1] & ~mask) | (laddr & mask);
+}
+
+//--------------------------------------------------------------------
+// call <func> for each page in range that the client has written to
+// since the last call, or for every memory page with <all>
+//--------------------------------------------------------------------
+uint32 h68k_CollectDirty(uint32 start, uint32 end, bool all, void(*func)(uint32 laddr, uint32 paddr))
+{
+    uint32 mask = h68k_mmu_pagesize - 1;
+    uint32 count = 0;
+
+    // the mmu sets M in memory, behind the data cache
+    __asm__ volatile (			    \
+        "\n movec cacr,d0"          \
+        "\n or.w #0x0800,d0"        \
+        "\n movec d0,cacr"          \
+        : : : "d0", "cc", "memory"  \
+    );
+    for (uint32 laddr = start & ~mask; laddr < end; laddr += h68k_mmu_pagesize) {
+        uint32* atc = h68k_GetMmuDescriptor(laddr);
+        if ((atc[0] & MMU_DT) != MMU_PAGE)
+            continue;
+        if (!all && !(atc[0] & MMU_M))
+            continue;
+        atc[0] &= ~MMU_M;
+        func(laddr, atc[1] & ~mask);
+        count++;
+    }
+
+    // atc entries remember M as well
+    if (count)
+        h68k_FlushAtc();
+    return count;
+}
+
+#if H68K_CACHE
+//--------------------------------------------------------------------
+// self modifying code detection
+//--------------------------------------------------------------------
+void h68k_PrepareCodePages()
+{
+    uint32 pages = 0x01000000 / h68k_mmu_pagesize;
+    for (uint32 i=0; i<pages; i++) {
+        if (h68k_mmu_code[i] != CODE_NONE)
+            continue;                                               // already tracked
+        uint32* atc = &h68k_mmu_table[i<<1];
+        uint32* ptc = &h68k_mmu_ptable[i<<1];
+        if ((atc[0] & (MMU_DT | MMU_WP | MMU_CI | MMU_S)) == MMU_PAGE) {
+            h68k_mmu_code[i] = CODE_DATA;
+            ptc[0] = 0;
+            ptc[1] = 0;
+        } else {
+            ptc[0] = atc[0];
+            ptc[1] = atc[1];
+        }
+    }
+}
+
+// berr: client fetched from a page that is invalid in the program tree
+bool h68k_CodeFetchFault(uint32 addr)
+{
+    uint32 i = (addr & 0x00FFFFFF) / h68k_mmu_pagesize;
+    uint8 state = h68k_mmu_code[i];
+    if ((state & CODE_STATE) != CODE_DATA)
+        return false;
+
+    uint32* atc = &h68k_mmu_table[i<<1];
+    uint32* ptc = &h68k_mmu_ptable[i<<1];
+    ptc[1] = atc[1];
+    ptc[0] = atc[0];
+    atc[0] |= MMU_WP;
+    h68k_mmu_code[i] = (state & ~CODE_STATE) | CODE_EXEC;
+    h68k_SetHotPage(H68K_HOT_CODE, addr, true);
+    h68k_FlushAtcUserPage(addr);
+    return true;
+}
+
+// berr: client, or host on its behalf, wrote to a page it executed from
+bool h68k_CodeWriteFault(uint32 addr)
+{
+    uint32 i = (addr & 0x00FFFFFF) / h68k_mmu_pagesize;
+    uint8 state = h68k_mmu_code[i];
+    if ((state & CODE_STATE) != CODE_EXEC)
+        return false;
+
+    uint32* atc = &h68k_mmu_table[i<<1];
+    uint32* ptc = &h68k_mmu_ptable[i<<1];
+    atc[0] &= ~MMU_WP;
+    state += CODE_FLIP;
+    if (state >= CODE_FLIPMAX) {
+        ptc[0] = atc[0] | MMU_CI;
+        state = (state & ~CODE_STATE) | CODE_MIXED;
+    } else {
+        ptc[0] = 0;
+        ptc[1] = 0;
+        state = (state & ~CODE_STATE) | CODE_DATA;
+    }
+    h68k_mmu_code[i] = state;
+    h68k_FlushAtcUserPage(addr);
+    __asm__ volatile (			    \
+        "\n movec cacr,d0"          \
+        "\n or.w #0x0008,d0"        \
+        "\n movec d0,cacr"          \
+        : : : "d0", "cc", "memory"  \
+    );
+    return true;
 }
+#endif
 
 //--------------------------------------------------------------------
 // map read/write access handlers
@@ -692,6 +1105,9 @@ void h68k_MapAccessHandlerEx(
     DPRINT("Map: [%02x] 0x%08x-0x%08x", userdata, start, end);
     for (;is < ie; is++) {
         LongInvalidDescriptor(h68k_mmu_table, is, userdata, (uint32)mem);
+#if H68K_CACHE
+        h68k_mmu_code[is] = CODE_NONE;
+#endif
     }
 }
 
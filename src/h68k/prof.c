@@ -0,0 +1,135 @@
+//--------------------------------------------------------------------
+// Hyper68k : prof.c
+// Statistical profiler for the client
+//--------------------------------------------------------------------
+
+//--------------------------------------------------------------------
+// A host owned periodic interrupt samples the interrupted client PC
+// into a hashed histogram. Nothing is done between samples so the
+// client runs at full speed.
+//
+// Each entry is PC (24bit) + mode in the upper bits:
+//      PROF_SUPER : client was in supervisor mode
+//      PROF_HOST  : host code was interrupted (idle in STOP etc.)
+//                   all of these share a single entry
+//
+// The saved file is plain text, one "pc mode count" line per entry,
+// for symbolising against the client binary afterwards.
+//--------------------------------------------------------------------
+#include "h68k.h"
+#include "stdio.h"
+
+#define PROF_SUPER      0x80000000
+#define PROF_HOST       0x40000000
+#define PROF_PROBES     16
+
+struct h68kProfEntry {
+    uint32 pc;
+    uint32 count;
+};
+
+static struct h68kProfEntry* prof_table;
+static uint32 prof_mask;
+static uint32 prof_samples;
+static uint32 prof_dropped;
+static bool prof_passon;
+static h68kHostVector prof_chain;
+
+
+//--------------------------------------------------------------------
+// Host vector
+//--------------------------------------------------------------------
+static bool h68k_ProfilerChain(uint32 vec, uint16* frame)
+{
+    bool handled = prof_chain ? prof_chain(vec, frame) : false;
+    return handled || !prof_passon;
+}
+
+static bool h68k_ProfilerSample(uint32 vec, uint16* frame)
+{
+    uint32 pc = *((uint32*)&frame[1]) & 0x00FFFFFF;
+    if (frame[0] & 0x2000)
+        pc = PROF_HOST;
+    else if (client_sr)
+        pc |= PROF_SUPER;
+
+    prof_samples++;
+    uint32 idx = ((pc >> 1) ^ (pc >> 13)) & prof_mask;
+    for (uint32 i=0; i<PROF_PROBES; i++) {
+        struct h68kProfEntry* e = &prof_table[idx];
+        if (e->pc == pc) {
+            e->count++;
+            return h68k_ProfilerChain(vec, frame);
+        } else if (e->count == 0) {
+            e->pc = pc;
+            e->count = 1;
+            return h68k_ProfilerChain(vec, frame);
+        }
+        idx = (idx + 1) & prof_mask;
+    }
+    prof_dropped++;
+    return h68k_ProfilerChain(vec, frame);
+}
+
+
+//--------------------------------------------------------------------
+//
+// Start sampling on every <vec> exception.
+// <entries> must be a power of two.
+// With <passon> the exception continues to the client afterwards,
+// use it when sampling on an interrupt that the client also needs.
+// A host handler already on <vec> keeps running after each sample.
+// Call before h68k_Run(), a table of another size is reallocated.
+//
+//--------------------------------------------------------------------
+bool h68k_ProfilerStart(uint32 vec, uint32 entries, bool passon)
+{
+    if ((entries == 0) || (entries & (entries - 1)))
+        return false;
+    if (prof_table && (prof_mask != entries - 1)) {
+        FreeMem((uint32)prof_table);
+        prof_table = 0;
+    }
+    if (prof_table == 0) {
+        prof_table = (struct h68kProfEntry*)AllocMem(entries * sizeof(struct h68kProfEntry), 4);
+        if (prof_table == 0)
+            return false;
+        prof_mask = entries - 1;
+    }
+    SetMem((uint8*)prof_table, 0, (prof_mask + 1) * sizeof(struct h68kProfEntry));
+    prof_samples = 0;
+    prof_dropped = 0;
+    prof_passon = passon;
+    if (h68k_GetHostVector(vec) != h68k_ProfilerSample)
+        prof_chain = h68k_GetHostVector(vec);
+    h68k_SetHostVector(vec, h68k_ProfilerSample);
+    return true;
+}
+
+
+//--------------------------------------------------------------------
+//
+// Write histogram, call after h68k_Run() has returned
+//
+//--------------------------------------------------------------------
+bool h68k_ProfilerSave(const char* filename)
+{
+    if (prof_table == 0)
+        return false;
+
+    FILE* f = fopen(filename, "w");
+    if (f == 0)
+        return false;
+
+    fprintf(f, "# samples %d dropped %d\n", prof_samples, prof_dropped);
+    fprintf(f, "# pc     mode count  (mode: u=user s=super h=host)\n");
+    for (uint32 i=0; i<=prof_mask; i++) {
+        struct h68kProfEntry* e = &prof_table[i];
+        if (e->count == 0)
+            continue;
+        char mode = (e->pc & PROF_HOST) ? 'h' : (e->pc & PROF_SUPER) ? 's' : 'u';
+        fprintf(f, "%06x %c %d\n", e->pc & 0x00FFFFFF, mode, e->count);
+    }
+    fclose(f);
+    return true;
+}
@@ -12,6 +12,15 @@ uint32 pviolu_table[0x10000];           // 256kb
 uint32 sfs_table[0x10000 / 4];          //  64kb
 uint32 vec_table[256];                  //   1kb
 uint32 ipl_table[256];                  //   1kb
+uint32 host_vec_table[256];             //   1kb
+
+#define VIRQ_QUEUE_SIZE 16
+uint8  virq_mask;
+uint8  virq_trace;
+uint16 virq_count;
+uint16 virq_queue[VIRQ_QUEUE_SIZE];
+
+void h68k_SetVectorTrampoline(uint32 vec);
 
 //-------------------------------------------------------
 //
@@ -53,6 +62,7 @@ bool h68k_InitVectors()
     // Usermode vectors (when client code is running)
 	//-------------------------------------------------------
     host_vbr = (uint8*)AllocMem(256*4, 256);
+    SetMem((uint8*)host_vec_table, 0, sizeof(host_vec_table));
 
     switch (client_cpu)
     {
@@ -148,6 +158,7 @@ bool h68k_InitVectors()
     //h68k_SetVectorHandler(0x0c, vec68000_BusError); 
     h68k_SetVectorHandler(0x0c, vec68000_AddrError);
     h68k_SetVectorHandler(0x20, vec68000_PrivilegeViolation);
+    h68k_SetVectorHandler(0x24, vec68000_Trace);
 
 
 	//--------------------------------------------------------------------------------------------------------------
@@ -347,12 +358,118 @@ void h68k_SetVectorHandler(uint32 vec, void(*func)()) {
 void h68k_SetVectorIpl(uint32 vec, uint32 ipl) {
     const uint32 idx = vec >> 2;
     ipl_table[idx] = (ipl << 24);
+    h68k_SetVectorTrampoline(vec);
 }
 void h68k_SetVector(uint32 vec, uint32 ipl, void(*func)()) {
     const uint32 idx = vec >> 2;
+    host_vec_table[idx] = 0;
     vec_table[idx] = (uint32)func;
     ipl_table[idx] = (ipl << 24);
     h68k_SetVectorHandler(vec, func);
+    h68k_SetVectorTrampoline(vec);
+}
+
+//-------------------------------------------------------
+// Interrupts always arrive with a short frame so the
+// generic trampolines can be swapped for the ones with
+// the ipl built in. vec_table keeps the generic version
+// for anyone jumping there with a different frame.
+//-------------------------------------------------------
+void(* const vec68000_IntTable[8])() = {
+    0, vec68000_Int1, vec68000_Int2, vec68000_Int3,
+    vec68000_Int4, vec68000_Int5, vec68000_Int6, vec68000_Int7
+};
+
+void h68k_SetVectorTrampoline(uint32 vec) {
+    const uint32 idx = vec >> 2;
+    if (host_vec_table[idx])
+        return;
+    if (((vec < 0x60) || (vec >= 0x80)) && (vec < 0x100))
+        return;
+    void(*func)() = (void(*)()) vec_table[idx];
+    uint32 ipl = (ipl_table[idx] >> 24) & 7;
+    if ((client_cpu == H68K_CPU_68000) && ipl && ((func == vec68000_Group1) || (func == vec68000_Group2))) {
+        func = vec68000_IntTable[ipl];
+    }
+    h68k_SetVectorHandler(vec, func);
+}
+
+//-------------------------------------------------------
+//
+// Client and host owned vectors
+//
+// Host vectors are handled entirely by the hypervisor.
+// The handler gets the vector offset and the host
+// exception frame and returns true if it dealt with it,
+// or false to have it passed on to the client.
+//
+//-------------------------------------------------------
+void h68k_SetClientVector(uint32 vec, uint32 ipl, void(*func)()) {
+    h68k_SetVector(vec, ipl, func);
+}
+void h68k_SetHostVector(uint32 vec, h68kHostVector func) {
+    const uint32 idx = vec >> 2;
+    host_vec_table[idx] = (uint32)func;
+    h68k_SetVectorHandler(vec, vec68000_Host);
+}
+
+h68kHostVector h68k_GetHostVector(uint32 vec) {
+    const uint32 idx = vec >> 2;
+    return (h68kHostVector)host_vec_table[idx];
+}
+void h68k_ClearHostVector(uint32 vec) {
+    const uint32 idx = vec >> 2;
+    host_vec_table[idx] = 0;
+    h68k_SetVectorHandler(vec, (void(*)())vec_table[idx]);
+    h68k_SetVectorTrampoline(vec);
+}
+
+//-------------------------------------------------------
+//
+// Virtual interrupts
+//
+// Lets emulated devices raise client interrupts without
+// blocking in their io handlers. They are queued and
+// delivered on the way out of the next bus error or
+// privilege violation handler, or host vector, once the
+// client ipl is below their level.
+// The client handler runs at the ipl set up for the vector.
+//
+// Call from io handlers and host vectors only, they run
+// with interrupts disabled.
+//
+//-------------------------------------------------------
+bool h68k_RaiseInterrupt(uint32 vec, uint32 level) {
+    if (virq_count >= VIRQ_QUEUE_SIZE)
+        return false;
+    level &= 7;
+    virq_queue[virq_count++] = (uint16)((level << 12) | (vec & 0x3FC));
+    virq_mask |= (1 << level);
+    return true;
+}
+
+uint32 h68k_NextInterrupt(uint32 ipl) {
+    // highest level first, oldest first within a level
+    uint16 best = VIRQ_QUEUE_SIZE;
+    uint32 level = ipl;
+    for (uint16 i=0; i<virq_count; i++) {
+        if ((virq_queue[i] >> 12) > level) {
+            level = virq_queue[i] >> 12;
+            best = i;
+        }
+    }
+    if (best == VIRQ_QUEUE_SIZE)
+        return 0;
+
+    uint32 vec = virq_queue[best] & 0x3FC;
+    virq_count--;
+    virq_mask = 0;
+    for (uint16 i=0; i<virq_count; i++) {
+        if (i >= best)
+            virq_queue[i] = virq_queue[i + 1];
+        virq_mask |= (1 << (virq_queue[i] >> 12));
+    }
+    return vec;
 }
 
 //-------------------------------------------------------
@@ -5,10 +5,14 @@
 // (c)2023 Anders Granlund
 //----------------------------------------------------------------------------------
 #include "common.h"
+#include "dma.h"
+#include "fdc.h"
+#include "acsi.h"
 #include "h68k/h68k.h"
 #include "stdio.h"
 #include "string.h"
 #include <mint/osbind.h>
+#include <mint/cookie.h>
 
 //----------------------------------------------------------------------------------
 uint32 cart_data;
@@ -22,11 +26,24 @@ uint16 rom_ver;
 uint32 ram_data;
 uint32 ram_size;
 uint8  ram_offs;  // high byte offset
+bool   ram_fast;  // backed by fast-ram, st-ram mirrors it for shifter and dma
+uint32 st_data;   // st-ram seen by shifter and dma as client address 0
 
 uint32 zero_data;
 uint32 zero_size;
 
+uint32 alt_data;
+uint32 alt_size;
+uint32 alt_stub;
+
 #define RAM_TEST 0
+#define RAM_HIGH 1      // client ram in a reserved st-ram block, host memory survives the session
+#define RAM_FAST 1      // client ram in fast-ram when there is enough of it
+#define ALT_RAM  0      // kb of client alt-ram at 0x400000, in fast-ram, registered with Maddalt
+#define PROFILE  0      // sample client pc, written to profile.txt on exit
+#define BENCH    0      // exception placement and memory primitive benchmarks
+#define FLOPPY_REALTIME 0   // floppy image commands take as long as on a real drive
+#define IDLE_DETECT 0       // park the host while the client polls mfp interrupt state
 
 //----------------------------------------------------------------------------------
 bool InitRam(uint32 kb);
@@ -38,8 +55,20 @@ void PatchTos2(uint8* rom, uint32 size);
 void OnResetCpu();
 void OnResetDevices();
 void OnFatal(struct h68kFatalDump* dump);
+void OnHostCall(bool enter);
 
 void setlowres();
+void StartProfiler();
+void StopProfiler();
+void BenchPlacement();
+void BenchMem();
+void SetCacheMode();
+uint32 PageAddress(uint32 laddr);
+void wb_vidbase(uint32 addr, uint8* data);
+bool InitAltRam(uint32 kb);
+bool OnGemdosAltRam(uint32 vec, uint16* frame);
+void SaveHost();
+void RestoreHost();
 
 #define RW_OK   0
 #define RW_FAIL ~0
@@ -54,20 +83,25 @@ void rb_mmuconf(uint32 addr, uint8* out) {
     *out = reg_stmmu;    
 }
 
+uint8 ram_bankconf;     // bank configuration the client ram is mapped with
+
+uint32 BankAddress(uint32 laddr) {
+    uint32 paddr;
+    switch (ram_bankconf) {
+        case 0: paddr = ((laddr & 0x03fe00)<<1) | (laddr & 0x0003ff); break;
+        case 1: paddr = laddr; break;
+        default: paddr = ((laddr & 0x0ff800)>>1) | (laddr & 0x0003ff); break;
+    }
+    return paddr + ((paddr < zero_size) ? zero_data : ram_data);
+}
+
 void wb_mmuconf(uint32 addr, uint8* in) {
     reg_stmmu = *in;
-    uint8 bank_conf = (reg_stmmu >> 2);
-    uint32 pagesize = h68k_GetMmuPageSize();
-    for (uint32 laddr = 0; laddr < ram_size; laddr += pagesize)
-    {
-        uint32 paddr;
-        switch (bank_conf) {
-            case 0: paddr = ((laddr & 0x03fe00)<<1) | (laddr & 0x0003ff); break;
-            case 1: paddr = laddr; break;
-            default: paddr = ((laddr & 0x0ff800)>>1) | (laddr & 0x0003ff); break;
-        }
-        paddr += (paddr < zero_size) ? zero_data : ram_data;
-        h68k_RemapPage(laddr, paddr);
+    uint8 bank_conf = (reg_stmmu >> 2) & 3;
+    bank_conf = (bank_conf > 2) ? 2 : bank_conf;
+    if (bank_conf != ram_bankconf) {            // tos writes this on every reset
+        ram_bankconf = bank_conf;
+        h68k_RemapRange(0, ram_size, PageAddress);
     }
 }
 
@@ -75,8 +109,8 @@ void wb_mmuconf(uint32 addr, uint8* in) {
 // ram address high byte translation (floppy dma / shifter)
 //----------------------------------------------------------------------------------
 void rb_addrH(uint32 addr, uint8* data) {
-    uint8 d = *((volatile uint32*)addr);
-    d = (d >= 0x40) ? d : d - ram_offs;
+    uint8 d = *((volatile uint8*)addr);
+    d = ((d >= ram_offs) && (d < ram_offs + 0x40)) ? d - ram_offs : d;
     *data = d;
 }
 
@@ -86,6 +120,134 @@ void wb_addrH(uint32 addr, uint8* data) {
     *((uint8*)addr) = d;
 }
 
+//----------------------------------------------------------------------------------
+// dma controller, transfers to ram go around the data cache
+//----------------------------------------------------------------------------------
+uint16 dma_mode;        // last mode the client wrote, put back after host calls
+uint32 dma_addr;        // progress of a transfer to ram, synced to fast-ram up to here
+uint32 dma_end;
+
+void SyncToSt(uint32 start, uint32 end);
+void SyncFromSt(uint32 start, uint32 end);
+
+uint32 DmaAddress() {
+    volatile uint8* dma = (volatile uint8*)0xff8600;
+    return ((dma[0x09] << 16) | (dma[0x0b] << 8) | dma[0x0d]) - st_data;
+}
+
+void DmaSetAddress(uint32 addr) {
+    volatile uint8* dma = (volatile uint8*)0xff8600;
+    addr += st_data;
+    dma[0x0d] = addr;
+    dma[0x0b] = addr >> 8;
+    dma[0x09] = addr >> 16;
+}
+
+// emulated device transfer, through the host address of each client page
+void DmaCopy(uint32 laddr, uint8* buf, uint32 size, bool toclient) {
+    uint32 pagesize = h68k_GetMmuPageSize();
+    uint32 start = laddr;
+    uint32 end = laddr + size;
+    end = (end < ram_size) ? end : ram_size;
+    while (laddr < end) {
+        uint32 n = pagesize - (laddr & (pagesize - 1));
+        n = (n < end - laddr) ? n : end - laddr;
+        uint32 haddr = h68k_GetHostAddress(laddr);
+        if (haddr) {
+            if (toclient)
+                CopyMem((uint8*)haddr, buf, n);
+            else
+                CopyMem(buf, (uint8*)haddr, n);
+        }
+        buf += n; laddr += n;
+    }
+    dma_addr = dma_end = 0;                     // nothing left for the hardware to sync
+    if (toclient && ram_fast && (start < end))
+        SyncToSt(start, end);                   // dma writes are seen by the shifter too
+}
+
+// fdc/hdc interrupt line of emulated devices, GPIP bit 5 (active low)
+uint8 dma_irq;
+
+void DmaRaiseIrq(uint8 src) {
+    dma_irq |= src;
+    volatile uint8* mfp = (volatile uint8*)0xfffa00;
+    if (mfp[0x09] & mfp[0x15] & 0x80)           // ierb & imrb
+        h68k_RaiseInterrupt(((mfp[0x17] & 0xF0) + 7) << 2, 6);
+}
+
+void DmaClearIrq(uint8 src) {
+    dma_irq &= ~src;
+}
+
+void rb_gpip(uint32 addr, uint8* data) {
+    h68k_IoReadBytePT(addr, data);
+    if (dma_irq)
+        *data &= ~0x20;
+}
+
+void rw_gpip(uint32 addr, uint16* data) {
+    h68k_IoReadWordPT(addr, data);
+    if (dma_irq)
+        *data &= ~0x0020;
+}
+
+void DmaSync() {
+    if (dma_addr < dma_end) {
+        uint32 addr = DmaAddress();
+        addr = (addr < dma_end) ? addr : dma_end;
+        if (addr > dma_addr) {
+            if (ram_fast)
+                SyncFromSt(dma_addr, addr);
+            dma_addr = addr;
+            if (dma_addr == dma_end)
+                h68k_FlushCache();                      // transfer complete
+        }
+    }
+}
+
+void rw_dma(uint32 addr, uint16* data) {
+    if (FloppyReadWord(addr, data) || AcsiReadWord(addr, data))
+        return;
+    h68k_IoReadWordPT(addr, data);
+    DmaSync();
+}
+
+void ww_dma(uint32 addr, uint16* data) {
+    if (FloppyWriteWord(addr, data) || AcsiWriteWord(addr, data))
+        return;
+    DmaSync();
+    if (addr == 0xff8606) {
+        dma_mode = *data;
+    } else if (dma_mode & 0x10) {                       // sector count, transfer is starting
+        uint32 start = DmaAddress();
+        uint32 end = start + ((*data & 0xff) * 512);
+        if (dma_mode & 0x100) {
+            if (ram_fast)
+                SyncToSt(start, end);                   // ram -> disk
+            dma_addr = dma_end = 0;
+        } else {
+            dma_addr = start;                           // disk -> ram, tracked as it progresses
+            dma_end = end;
+        }
+        h68k_FlushCache();
+    }
+    h68k_IoWriteWordPT(addr, data);
+}
+
+void rl_dma(uint32 addr, uint32* data) {
+    uint16 d[2];
+    rw_dma(addr, &d[0]);
+    rw_dma(addr + 2, &d[1]);
+    *data = (d[0] << 16) | d[1];
+}
+
+void wl_dma(uint32 addr, uint32* data) {
+    uint16 d[2] = { *data >> 16, *data };
+    ww_dma(addr, &d[0]);
+    ww_dma(addr + 2, &d[1]);
+}
+
 
 //----------------------------------------------------------------------------------
 //
@@ -96,12 +258,11 @@ int appmain(int args, char** argv)
 {
     
     DPRINT("Hyper68");
-    client_cpu = H68K_CPU_68000;
-    host_cpu = H68K_CPU_68030;
 
     char* fname_rom = "tos.rom";
     char* fname_cart = "cart.stc";
-    //char* fname_floppy = 0;
+    char* fname_floppy = 0;
+    char* fname_acsi = "acsi.hd";
 
     // drag-and-dropped something onto us?
     if (args == 2 && argv[1] != 0 && *argv[1] != 0) {
@@ -117,6 +278,12 @@ int appmain(int args, char** argv)
                     else if (stricmp(&fname[i+1], "img") == 0) {
                         fname_rom = fname;
                     }
+                    else if ((stricmp(&fname[i+1], "st") == 0) || (stricmp(&fname[i+1], "msa") == 0)) {
+                        fname_floppy = fname;
+                    }
+                    else if (stricmp(&fname[i+1], "hd") == 0) {
+                        fname_acsi = fname;
+                    }
                 }
             }
         }
@@ -127,12 +294,26 @@ int appmain(int args, char** argv)
     //
 
     InitMem(2 * 1024 * 1024);
+    DPRINT(" Code: 0x%08x (%s)", (uint32)appmain, ((uint32)appmain < 0x01000000) ? "st-ram" : "fast-ram");
 
     // Init hypervisor and setup callbacks
     h68k_Init();
+#if BENCH
+    BenchPlacement();
+    BenchMem();
+#endif
+    client_cpu = H68K_CPU_68000;
+    host_cpu = H68K_CPU_68030;
     h68k_SetCpuResetCallback(OnResetCpu);
     h68k_SetDeviceResetCallback(OnResetDevices);
     h68k_SetFatalCallback(OnFatal);
+    h68k_SetHostCallCallback(OnHostCall);
+#if IDLE_DETECT
+    h68k_SetIdleDetect(32);                 // sleep through io polling loops
+#endif
+    SetCacheMode();
+    h68k_SetLatencyTimer((volatile uint8*)0xfffa23, 192, 26042, 0x114);   // mfp timer c, 200hz system tick
+    h68k_SetStatsReport(0x70, 250, 20000);  // hypervisor overhead per 250 VBLs, printed on exit
 
     // Default entire memory map as passthrough with bus-error detect
     // todo: use fast passthrough and set up relevant addresses as berr triggers
@@ -146,6 +327,7 @@ int appmain(int args, char** argv)
     
     // Setup IO
     h68k_MapInvalid(0x400000, 0xE00000);    // altram
+    InitAltRam(ALT_RAM);
 
     //h68k_MapPassThroughSafe(0x00FF8000, 0x01000000);
     h68k_MapPassThrough(0x00FF8000, 0x01000000);
@@ -198,13 +380,18 @@ int appmain(int args, char** argv)
         h68k_MapIoLong(i, h68k_IoBerrLong, h68k_IoBerrLong);
     }
     
+    // dma, flush data cache on controller access
+    h68k_MapIoRangeEx(0xff8600, 0xff8700, h68k_IoReadBytePT, h68k_IoWriteBytePT, h68k_IoReadWordPT, h68k_IoWriteWordPT, h68k_IoReadLongPT, h68k_IoWriteLongPT);
+    h68k_MapIoWord(0xff8604, rw_dma, ww_dma);           // fdc / hdc access
+    h68k_MapIoWord(0xff8606, rw_dma, ww_dma);           // dma mode / status
+    h68k_MapIoLong(0xff8604, rl_dma, wl_dma);           // data + mode in one go, acsi commands
+
     // set up register intercepts for when emulated ram isn't sharing same address as real ram
-    if (ram_data != 0)
+    if (st_data != 0)
     {
-        ASSERT((ram_data & 0xFFFF) == 0, "Emulated RAM unaligned");
+        ASSERT((st_data & 0xFFFF) == 0, "Emulated RAM unaligned");
 
         // dma
-        h68k_MapIoRangeEx(0xff8600, 0xff8700, h68k_IoReadBytePT, h68k_IoWriteBytePT, h68k_IoReadWordPT, h68k_IoWriteWordPT, h68k_IoReadLongPT, h68k_IoWriteLongPT);
         h68k_MapIoByte(0xff8609, rb_addrH, wb_addrH);   // DMA address
 
         // shifter
@@ -214,6 +401,22 @@ int appmain(int args, char** argv)
 
     }
 
+    // screen pages of fast-ram backed client ram are moved to st-ram
+    if (ram_fast) {
+        h68k_MapIoByte(0xff8201, rb_addrH, wb_vidbase);
+        h68k_MapIoByte(0xff8203, h68k_IoReadBytePT, wb_vidbase);
+    }
+
+    // emulated dma devices, on the fdc/hdc interrupt line
+    h68k_MapIoByte(0xfffa01, rb_gpip, h68k_IoWriteBytePT);
+    h68k_MapIoWord(0xfffa00, rw_gpip, h68k_IoWriteWordPT);
+
+    // floppy image in drive A
+    InitFloppy(fname_floppy, FLOPPY_REALTIME);
+
+    // hard disk image on the acsi bus
+    InitAcsi(fname_acsi);
+
     for (uint32 i=0x00; i<0x60; i+=4) {
         h68k_SetVectorIpl(i, 7);
     }
@@ -272,13 +475,24 @@ int appmain(int args, char** argv)
 
     DbgInit(DBG_NONE);
 
+    SaveHost();
     Setscreen( -1, -1, 0 );
     //setlowres();
 
+#if PROFILE
+    StartProfiler();
+#endif
+
     // Back in time we go!
     h68k_Run();
 
-    // todo: host machine specific exit
+#if PROFILE
+    StopProfiler();
+    h68k_ProfilerSave("profile.txt");
+#endif
+
+    RestoreHost();
+    ShutdownAcsi();
 
     if (h68k_GetLastError()) {
         DPRINT(h68k_GetLastError());
@@ -297,6 +511,8 @@ int appmain(int args, char** argv)
 void OnResetCpu()
 {
     DPRINT("OnResetCpu");
+    if (alt_size)
+        h68k_SetHostVector(0x84, OnGemdosAltRam);   // announce alt-ram again
 /*    
     static uint16 counter = 0;
     if (counter++ > 0) {
@@ -308,6 +524,7 @@ void OnResetCpu()
 void OnResetDevices()
 {
     DPRINT("OnResetDevices");
+    ResetAcsi();
 }
 
 void OnFatal(struct h68kFatalDump* dump)
@@ -316,17 +533,227 @@ void OnFatal(struct h68kFatalDump* dump)
 }
 
 
+//----------------------------------------------------------------------------------
+//
+// Host state
+//
+// Hardware the client takes over directly and the host OS expects back the way
+// it left it. Timer data registers read back the running count, not the reload
+// value, so timer C is given the standard 200hz value instead.
+//
+//----------------------------------------------------------------------------------
+static const uint8 host_mfpregs[] = { 0x03, 0x05, 0x07, 0x09, 0x13, 0x15, 0x17, 0x19, 0x1b, 0x1d };
+uint8  host_mfp[sizeof(host_mfpregs)];
+uint16 host_pal[16];
+uint32 host_phys;
+uint32 host_log;
+sint16 host_rez;
+
+void SaveHost()
+{
+    volatile uint8* mfp = (volatile uint8*)0xfffa00;
+    for (uint16 i=0; i<sizeof(host_mfpregs); i++)
+        host_mfp[i] = mfp[host_mfpregs[i]];
+    for (uint16 i=0; i<16; i++)
+        host_pal[i] = Setcolor(i, -1);
+    host_phys = (uint32)Physbase();
+    host_log = (uint32)Logbase();
+    host_rez = Getrez();
+}
+
+void RestoreHost()
+{
+    volatile uint8* mfp = (volatile uint8*)0xfffa00;
+    mfp[0x07] = 0;                              // interrupts off while reprogramming
+    mfp[0x09] = 0;
+    mfp[0x0b] = 0;
+    mfp[0x0d] = 0;
+    mfp[0x0f] = 0;
+    mfp[0x11] = 0;
+    mfp[0x1d] = 0;                              // timerC+D stop
+    mfp[0x23] = 192;                            // timerC data
+    for (uint16 i=0; i<sizeof(host_mfpregs); i++)
+        mfp[host_mfpregs[i]] = host_mfp[i];
+
+    (void)Giaccess(0xFF, 0x87);                 // psg : all channels off
+
+    static const uint8 ikbd_reset[] = { 0x80, 0x01, 0x08 };
+    Ikbdws(sizeof(ikbd_reset) - 1, ikbd_reset); // keyboard reset, relative mouse
+
+    Setscreen(host_log, host_phys, host_rez);
+    Setpalette(host_pal);
+    Vsync();
+}
+
+// mfp interrupt setup while in h68k_HostCall, so client enabled sources
+// don't end up in the host's handlers (the ikbd one would eat client input)
+static const uint8 call_mfpregs[] = { 0x07, 0x09, 0x13, 0x15, 0x17 };  // iera, ierb, imra, imrb, vr
+uint8 call_mfp[sizeof(call_mfpregs)];
+
+// the host's disk driver reprograms the dma chip, the client's address and
+// mode go back afterwards so a transfer it had set up still lands where it
+// expects. A direction change on the mode write resets the sector count,
+// clients set that again after toggling anyway.
+uint32 call_dmaaddr;
+
+void OnHostCall(bool enter)
+{
+    volatile uint8* mfp = (volatile uint8*)0xfffa00;
+    volatile uint8* dma = (volatile uint8*)0xff8600;
+    if (enter) {
+        call_dmaaddr = (dma[0x09] << 16) | (dma[0x0b] << 8) | dma[0x0d];
+    } else {
+        dma[0x0d] = call_dmaaddr;
+        dma[0x0b] = call_dmaaddr >> 8;
+        dma[0x09] = call_dmaaddr >> 16;
+        *((volatile uint16*)0xff8606) = dma_mode;
+    }
+    for (uint16 i=0; i<sizeof(call_mfpregs); i++) {
+        uint8 reg = call_mfpregs[i];
+        if (enter) {
+            call_mfp[i] = mfp[reg];
+            for (uint16 j=0; j<sizeof(host_mfpregs); j++) {
+                if (host_mfpregs[j] == reg)
+                    mfp[reg] = host_mfp[j];
+            }
+        } else {
+            mfp[reg] = call_mfp[i];
+        }
+    }
+}
+
+
+//----------------------------------------------------------------------------------
+//
+// Cache setup
+//
+// Only TT-RAM can burst fill cache lines, ST-RAM and Falcon memory can't.
+//
+//----------------------------------------------------------------------------------
+void SetCacheMode()
+{
+    long mch = 0;
+    bool tt = (Getcookie(C__MCH, &mch) == C_FOUND) && ((mch >> 16) == 2);
+    if (tt) {
+        h68k_SetCacheMode(H68K_CACR_EI | H68K_CACR_IBE | H68K_CACR_ED | H68K_CACR_DBE | H68K_CACR_WA);
+    } else {
+        h68k_SetCacheMode(H68K_CACR_EI | H68K_CACR_ED | H68K_CACR_WA);
+    }
+}
+
+
+//----------------------------------------------------------------------------------
+//
+// Fast-ram backed client ram
+//
+// Shifter and dma only see st-ram. Client ram lives in fast-ram with a copy at
+// st_data. Each page the client has pointed the screen at is moved over to its
+// st-ram copy for good, so the display never depends on the host getting a
+// VBL the client may have masked. Dma transfers are synced through the dma
+// address counter (see ww_dma).
+//
+//----------------------------------------------------------------------------------
+uint8* vid_st;          // per page, mapped to st-ram
+uint32 vid_base = ~0;
+
+void SyncToSt(uint32 start, uint32 end)
+{
+    uint32 pagesize = h68k_GetMmuPageSize();
+    end = (end < ram_size) ? end : ram_size;
+    h68k_FlushCache();                          // host and client see these through different addresses
+    while (start < end) {
+        uint32 n = pagesize - (start & (pagesize - 1));
+        n = (n < end - start) ? n : end - start;
+        uint32 src = h68k_GetHostAddress(start);
+        if (src)
+            CopyMem((uint8*)(st_data + start), (uint8*)src, n);
+        start += n;
+    }
+}
+
+void SyncFromSt(uint32 start, uint32 end)
+{
+    uint32 pagesize = h68k_GetMmuPageSize();
+    end = (end < ram_size) ? end : ram_size;
+    h68k_FlushCache();                          // host and client see these through different addresses
+    while (start < end) {
+        uint32 n = pagesize - (start & (pagesize - 1));
+        n = (n < end - start) ? n : end - start;
+        uint32 dst = h68k_GetHostAddress(start);
+        if (dst)
+            CopyMem((uint8*)dst, (uint8*)(st_data + start), n);
+        start += n;
+    }
+}
+
+uint32 PageAddress(uint32 laddr)
+{
+    if (vid_st && vid_st[laddr / h68k_GetMmuPageSize()])
+        return st_data + laddr;
+    return BankAddress(laddr);
+}
+
+void ScreenToSt(uint32 base)
+{
+    uint32 pagesize = h68k_GetMmuPageSize();
+    uint32 end = base + 32000;
+    if ((base == vid_base) || (base >= ram_size) || (end > ram_size))
+        return;
+    vid_base = base;
+    h68k_SetHotPage(H68K_HOT_VIDEO, base, false);
+
+    bool moved = false;
+    for (uint32 laddr = base & ~(pagesize - 1); laddr < end; laddr += pagesize) {
+        if (vid_st[laddr / pagesize] == 0) {
+            SyncToSt(laddr, laddr + pagesize);
+            vid_st[laddr / pagesize] = 1;
+            moved = true;
+        }
+    }
+    if (moved)
+        h68k_RemapRange(base, end, PageAddress);
+}
+
+void wb_vidbase(uint32 addr, uint8* data)
+{
+    if (addr == 0xff8201)
+        wb_addrH(addr, data);
+    else
+        h68k_IoWriteBytePT(addr, data);
+    uint32 base = ((*((volatile uint8*)0xff8201) << 16) | (*((volatile uint8*)0xff8203) << 8)) - st_data;
+    ScreenToSt(base);
+}
+
+
 //----------------------------------------------------------------------------------
 //
 // RAM Init
 //
+// With RAM_HIGH the st-ram side of client ram is a block of our own instead of
+// the host's memory at address 0, shifter and dma addresses are translated by
+// st_data (see rb_addrH / wb_addrH). The host OS is left intact and is still
+// there when h68k_Run() returns.
+//
 //----------------------------------------------------------------------------------
 bool InitRam(uint32 kb)
 {
     const uint32 ram_addr = 0;
     ram_data = ram_addr;
     ram_size = kb * 1024;
-    ram_offs = (ram_data >> 16) & 0xFF;
+    ram_fast = false;
+#if RAM_HIGH
+    ram_data = AllocMemEx(ram_size, 0x10000, MEM_ST);
+    DPRINT(" Ram: st-ram at 0x%08x", ram_data);
+#endif
+    st_data = ram_data;
+#if RAM_FAST
+    if ((long)Mxalloc(-1, 1) >= (long)(ram_size + 0x10000)) {
+        ram_data = AllocMemEx(ram_size, 0x10000, MEM_FAST);
+        ram_fast = true;
+        DPRINT(" Ram: fast-ram at 0x%08x", ram_data);
+    }
+#endif
+    ram_offs = (st_data >> 16) & 0xFF;
 
     // put the emulated zeropage somewhere fast
     if (h68k_GetMmuPageSize() <= 2048) {
@@ -343,6 +770,7 @@ bool InitRam(uint32 kb)
     CopyMem((uint8*)zero_data, (uint8*)rom_data, 8);
 
     // memorymap
+    ram_bankconf = 1;
     h68k_MapMemory(ram_addr, ram_addr + ram_size, ram_data);
     h68k_MapMemory(ram_addr, ram_addr + zero_size, zero_data);
     //h68k_MapDisconnected(ram_addr + ram_size, 0x00400000);
@@ -350,10 +778,233 @@ bool InitRam(uint32 kb)
     //h68k_MapDisconnected(ram_addr + ram_size, 0x00400000);
     h68k_MapIoRangeEx(ram_addr + ram_size, 0x00400000, h68k_IoIgnoreByte, h68k_IoIgnoreByte, h68k_IoReadWordBB, h68k_IoReadWordBB, h68k_IoReadLongBBBB, h68k_IoReadLongBBBB);
 
+    // screen pages are moved to st-ram as the client points the shifter at them
+    if (ram_fast) {
+        vid_st = (uint8*)AllocMem(ram_size / h68k_GetMmuPageSize(), 4);    // cleared
+        vid_base = ~0;
+    }
+
+    return true;
+}
+
+
+//----------------------------------------------------------------------------------
+//
+// Alt-RAM
+//
+// Client memory at 0x400000 backed by fast-ram. The client OS is told about it
+// with Maddalt(), from a stub in the page just after it: the first user mode
+// gemdos call returns into the stub, which makes the call and carries on to
+// where the client was going. TOS versions without Maddalt just fail the call.
+// Alt-ram is not dma capable, like on real hardware.
+//
+//----------------------------------------------------------------------------------
+bool InitAltRam(uint32 kb)
+{
+    const uint32 alt_addr = 0x400000;
+    uint32 pagesize = h68k_GetMmuPageSize();
+    uint32 size = kb * 1024;
+    size = (size < (0xE00000 - alt_addr - pagesize)) ? size : (0xE00000 - alt_addr - pagesize);
+    size &= ~(pagesize - 1);
+    alt_size = 0;
+    if ((size == 0) || ((long)Mxalloc(-1, 1) < (long)(size + 0x10000)))
+        return false;
+
+    alt_data = AllocMemEx(size, 0x10000, MEM_FAST);
+    alt_stub = AllocMemEx(pagesize, pagesize, MEM_ANY);
+    alt_size = size;
+    DPRINT(" Alt: 0x%08x : 0x%08x (%dKb)", alt_data, alt_addr, size / 1024);
+
+    uint16* stub = (uint16*)alt_stub;
+    *stub++ = 0x2f00;                                           // move.l d0,-(sp)
+    *stub++ = 0x2f3c; *stub++ = size >> 16; *stub++ = size;     // move.l #size,-(sp)
+    *stub++ = 0x2f3c; *stub++ = alt_addr >> 16; *stub++ = alt_addr; // move.l #start,-(sp)
+    *stub++ = 0x3f3c; *stub++ = 0x0014;                         // move.w #$14,-(sp)
+    *stub++ = 0x4e41;                                           // trap #1 (Maddalt)
+    *stub++ = 0x4fef; *stub++ = 0x000a;                         // lea 10(sp),sp
+    *stub++ = 0x201f;                                           // move.l (sp)+,d0
+    *stub++ = 0x4ef9;                                           // jmp <return address>.l
+
+    h68k_MapMemory(alt_addr, alt_addr + size, alt_data);
+    h68k_MapReadOnly(alt_addr + size, alt_addr + size + pagesize, alt_stub);
+    return true;
+}
 
+bool OnGemdosAltRam(uint32 vec, uint16* frame)
+{
+    if (client_sr != 0)
+        return false;                                           // wait for user mode
+
+    uint16 func;
+    __asm__ volatile (" move.l usp,a0\n moves.w (a0),%0\n" : "=d"(func) : : "a0");
+    if ((func == 0x00) || (func == 0x31) || (func == 0x4c))
+        return false;                                           // terminating calls don't return
+
+    uint16* ret = (uint16*)(alt_stub + 28);
+    ret[0] = frame[1];
+    ret[1] = frame[2];
+    frame[1] = (0x400000 + alt_size) >> 16;
+    frame[2] = (0x400000 + alt_size);
+    h68k_FlushCache();
+    h68k_ClearHostVector(0x84);
+    return false;
+}
+
+
+//----------------------------------------------------------------------------------
+//
+// Profiler
+//
+// TT: 1kHz from TT-MFP timer A, the client never sees that one.
+// Others: 1117Hz from MFP timer D, so samples don't line up with the VBL.
+// The client loses timer D while profiling, tos only uses it as baud rate clock.
+//
+//----------------------------------------------------------------------------------
+volatile uint8* const ttmfp = (volatile uint8*)0xfffa80;
+volatile uint8* const stmfp = (volatile uint8*)0xfffa00;
+bool prof_ttmfp;
+
+bool OnProfTimerD(uint32 vec, uint16* frame)
+{
+    stmfp[0x11] = ~0x10;                        // end of interrupt, st-mfp runs in software eoi mode
     return true;
 }
 
+void StartProfiler()
+{
+    long mch = 0;
+    prof_ttmfp = (Getcookie(C__MCH, &mch) == C_FOUND) && ((mch >> 16) == 2);
+    if (prof_ttmfp) {
+        uint32 vec = ((ttmfp[0x17] & 0xF0) + 13) * 4;
+        ttmfp[0x17] &= ~0x08;                   // automatic end of interrupt
+        ttmfp[0x19] = 0;                        // timer a stop
+        ttmfp[0x1f] = 12;                       // 2457600 / 200 / 12 = 1024Hz
+        ttmfp[0x19] = 7;                        // timer a start, prescale 200
+        ttmfp[0x07] |= 0x20;                    // timer a enable
+        ttmfp[0x13] |= 0x20;                    // timer a unmask
+        h68k_ProfilerStart(vec, 8192, false);
+    } else {
+        uint32 vec = ((stmfp[0x17] & 0xF0) + 4) * 4;
+        stmfp[0x1d] &= 0xF0;                    // timer d stop, timer c keeps running
+        stmfp[0x25] = 11;                       // 2457600 / 200 / 11 = 1117Hz
+        stmfp[0x1d] |= 7;                       // timer d start, prescale 200
+        stmfp[0x09] |= 0x10;                    // timer d enable
+        stmfp[0x15] |= 0x10;                    // timer d unmask
+        h68k_SetHostVector(vec, OnProfTimerD);
+        h68k_ProfilerStart(vec, 8192, false);
+    }
+}
+
+void StopProfiler()
+{
+    if (prof_ttmfp) {
+        ttmfp[0x19] = 0;                        // timer a stop
+        ttmfp[0x07] &= ~0x20;                   // timer a disable
+    } else {
+        stmfp[0x1d] &= 0xF0;                    // timer d stop
+        stmfp[0x09] &= ~0x10;                   // timer d disable
+        stmfp[0x25] = 2;                        // tos default, 9600 baud
+        stmfp[0x1d] |= 1;                       // timer d start, prescale 4
+        h68k_ClearHostVector(((stmfp[0x17] & 0xF0) + 4) * 4);
+    }
+}
+
+
+//----------------------------------------------------------------------------------
+//
+// Placement benchmark
+//
+// Times user mode move sr,d0 round trips through the hypervisor's privilege
+// violation handler, with the vector table and the supervisor stack in each
+// type of memory, 200Hz timer resolution. Needs the tables from h68k_Init().
+//
+//----------------------------------------------------------------------------------
+uint32 BenchPviol(uint32 vbr, uint32 ssp, uint32 count)
+{
+    uint32 t0 = *((volatile uint32*)0x4ba);
+    __asm__ volatile ( \
+        " movec   vbr,a1\n" \
+        " movec   sfc,a3\n" \
+        " move.l  sp,a2\n" \
+        " moveq   #1,d0\n" \
+        " movec   d0,sfc\n" \
+        " movec   %1,vbr\n" \
+        " move.l  %2,sp\n" \
+        " and.w   #0xdfff,sr\n" \
+        "1:move.w sr,d0\n" \
+        " subq.l  #1,%0\n" \
+        " bne.b   1b\n" \
+        " trap    #15\n" \
+        " move.l  a2,sp\n" \
+        " movec   a3,sfc\n" \
+        " movec   a1,vbr\n" \
+        : "+d"(count) : "a"(vbr), "a"(ssp) : "d0", "a1", "a2", "a3", "cc", "memory" );
+    return *((volatile uint32*)0x4ba) - t0;
+}
+
+void BenchPlacement()
+{
+    const uint32 count = 500000;
+    const uint16 types[2] = { MEM_ST, MEM_FAST };
+    const char* names[2] = { "st-ram", "fast-ram" };
+    uint32 vbr, cacr;
+    __asm__ volatile ( " movec vbr,%0\n movec cacr,%1\n" : "=d"(vbr), "=d"(cacr) );
+
+    for (uint16 i=0; i<2; i++) {
+        if ((types[i] == MEM_FAST) && ((long)Mxalloc(-1, 1) <= 0))
+            continue;                                               // no fast-ram
+        uint32 mem = AllocMemEx(0x400 + 16 + 4096, 256, types[i]);
+        CopyMem((uint8*)mem, (uint8*)vbr, 0x400);                 // keep system vectors working
+        *((uint32*)(mem + 0x20)) = (uint32)vec68000_PrivilegeViolation;
+        *((uint16*)(mem + 0x400)) = 0x08d7;                         // bset #5,(sp)
+        *((uint16*)(mem + 0x402)) = 0x0005;
+        *((uint16*)(mem + 0x404)) = 0x4e73;                         // rte, back in supervisor
+        *((uint32*)(mem + 0xbc)) = mem + 0x400;                     // trap #15
+        __asm__ volatile ( " movec cacr,d0\n or.w #0x0808,d0\n movec d0,cacr\n" : : : "d0", "cc" );
+        uint32 ticks = BenchPviol(mem, mem + 0x400 + 16 + 4096, count);
+        DPRINT("pviol: %s %d ns", names[i], (ticks * 5000) / (count / 1000));
+        FreeMem(mem);
+    }
+    __asm__ volatile ( " movec %0,cacr\n" : : "d"(cacr | 0x0808) );
+}
+
+
+//----------------------------------------------------------------------------------
+//
+// Memory primitive benchmark
+//
+// CopyMem/SetMem against the libc versions over a buffer well beyond the
+// caches, result in KB/s.
+//
+//----------------------------------------------------------------------------------
+void BenchMem()
+{
+    const uint32 size = 256 * 1024;
+    const uint32 loops = 16;
+    uint32 src = AllocMemEx(size, 16, MEM_ANY);
+    uint32 dst = AllocMemEx(size, 16, MEM_ANY);
+    uint32 t[4];
+    for (uint16 i=0; i<4; i++) {
+        uint32 t0 = *((volatile uint32*)0x4ba);
+        for (uint32 j=0; j<loops; j++) {
+            switch (i) {
+                case 0: CopyMem((uint8*)dst, (uint8*)src, size); break;
+                case 1: memcpy((void*)dst, (void*)src, size); break;
+                case 2: SetMem((uint8*)dst, 0x55, size); break;
+                case 3: memset((void*)dst, 0x55, size); break;
+            }
+        }
+        t[i] = *((volatile uint32*)0x4ba) - t0;
+        if (t[i] == 0)
+            t[i] = 1;
+    }
+    const uint32 kb = (size / 1024) * loops * 200;
+    DPRINT("copy: %d KB/s, memcpy %d KB/s", kb / t[0], kb / t[1]);
+    DPRINT("fill: %d KB/s, memset %d KB/s", kb / t[2], kb / t[3]);
+    FreeMem(dst);
+    FreeMem(src);
+}
+
 
 //----------------------------------------------------------------------------------
 //
@@ -441,57 +1092,88 @@ bool InitRom(const char* filename)
 
 
 //----------------------------------------------------------------------------------
-// TOS 1.x patches
+// Rom patching
+//
+// Each patch set is applied with a single scan over the rom, every
+// match of every pattern gets its fixup.
 //----------------------------------------------------------------------------------
-void PatchTos1(uint8* rom, uint32 size)
-{
-    const uint16 p1_startup_waitvbl[] = { 30,
-        0x41f9, 0xffff, 0xfa21, 0x43f9, 0xffff, 0xfa1b, 0x12bc, 0x0010, 0x7801, 0x12bc,
-        0x0000, 0x10bc, 0x00f0, 0x13fc, 0x0008, 0xffff, 0xfa1b, 0x1010, 0xb004, 0x66fa,
-        0x1810, 0x363c, 0x0267, 0xb810, 0x66f6, 0x51cb, 0xfffa, 0x12bc, 0x0010, 0x4ed6 };
+struct romPatch {
+    const char* name;
+    const uint16* pattern;
+    void(*apply)(uint16* p);
+};
 
-    uint16* p = FindMem(rom, size, p1_startup_waitvbl);
-    if (p) {
-        DPRINT("  Patching wait at 0x%08x", (uint32)p);
-        p[20] = 0x4e71;
-        p[22] = 0x0010; // move.w #16,d3    (was 615)
-        p[24] = 0x4e71;
+void PatchRomFound(uint16 idx, uint16* p, void* user)
+{
+    const struct romPatch* patch = &((const struct romPatch*)user)[idx];
+    DPRINT("  Patching %s at 0x%08x", patch->name, (uint32)p);
+    patch->apply(p);
+}
 
+void PatchRom(uint8* rom, uint32 size, const struct romPatch* patches, uint16 count)
+{
+    const uint16* patterns[FINDMEM_MAX];
+    for (uint16 i=0; i<count; i++) {
+        patterns[i] = patches[i].pattern;
     }
+    FindMemMulti(rom, size, patterns, count, PatchRomFound, (void*)patches);
 }
 
+
 //----------------------------------------------------------------------------------
-// TOS 2.x patches
+// TOS 1.x patches
 //----------------------------------------------------------------------------------
-void PatchTos2(uint8* rom, uint32 size)
+static const uint16 p1_startup_waitvbl[] = { 30,
+    0x41f9, 0xffff, 0xfa21, 0x43f9, 0xffff, 0xfa1b, 0x12bc, 0x0010, 0x7801, 0x12bc,
+    0x0000, 0x10bc, 0x00f0, 0x13fc, 0x0008, 0xffff, 0xfa1b, 0x1010, 0xb004, 0x66fa,
+    0x1810, 0x363c, 0x0267, 0xb810, 0x66f6, 0x51cb, 0xfffa, 0x12bc, 0x0010, 0x4ed6 };
+
+static void p1_startup_waitvbl_apply(uint16* p) {
+    p[20] = 0x4e71;
+    p[22] = 0x0010; // move.w #16,d3    (was 615)
+    p[24] = 0x4e71;
+}
+
+void PatchTos1(uint8* rom, uint32 size)
 {
-    const uint16 p1_startup_waitvbl[] = { 20,
-        0x41f8, 0xfa21, 0x43f8, 0xfa1b, 0x08b8, 0x0000, 0xfa07, 0x7801, 0x4211, 0x10bc,
-        0x00f0, 0x12bc, 0x0008, 0xb810, 0x66fc, 0x1810, 0x363c, 0x0267, 0xb810, 0x66f6 };
-    const uint16 p2_cpu_detect[] = { 12, 0x42c0, 0x720a, 0x49c0, 0x7214, 0x4e7a, 0x0002, 0x08c0, 0x0009, 0x4e7b, 0x0002, 0x4e7a, 0x0002 };
-    const uint16 p2_rom_crc[] = { 14, 0x5741, 0x524e, 0x494e, 0x473a, 0x2042, 0x4144, 0x2052, 0x4f4d, 0x2043, 0x5243, 0x2049, 0x4e20, 0x4348, 0x4950 };
+    const struct romPatch patches[] = {
+        { "wait",           p1_startup_waitvbl,     p1_startup_waitvbl_apply },
+    };
+    PatchRom(rom, size, patches, sizeof(patches) / sizeof(patches[0]));
+}
 
+//----------------------------------------------------------------------------------
+// TOS 2.x patches
+//----------------------------------------------------------------------------------
+static const uint16 p2_startup_waitvbl[] = { 20,
+    0x41f8, 0xfa21, 0x43f8, 0xfa1b, 0x08b8, 0x0000, 0xfa07, 0x7801, 0x4211, 0x10bc,
+    0x00f0, 0x12bc, 0x0008, 0xb810, 0x66fc, 0x1810, 0x363c, 0x0267, 0xb810, 0x66f6 };
+static const uint16 p2_cpu_detect[] = { 12, 0x42c0, 0x720a, 0x49c0, 0x7214, 0x4e7a, 0x0002, 0x08c0, 0x0009, 0x4e7b, 0x0002, 0x4e7a, 0x0002 };
+static const uint16 p2_rom_crc[] = { 14, 0x5741, 0x524e, 0x494e, 0x473a, 0x2042, 0x4144, 0x2052, 0x4f4d, 0x2043, 0x5243, 0x2049, 0x4e20, 0x4348, 0x4950 };
+
+static void p2_startup_waitvbl_apply(uint16* p) {
+    p[14] = 0x4e71; // nop
+    p[17] = 0x0010; // move.w #16,d0    (was 615)
+    p[19] = 0x4e71; // nop
+}
 
-    uint16* p = FindMem(rom, size, p1_startup_waitvbl);
-    if (p) {
-        DPRINT("  Patching wait at 0x%08x", (uint32)p);
-        p[14] = 0x4e71; // nop
-        p[17] = 0x0010; // move.w #16,d0    (was 615)
-        p[19] = 0x4e71; // nop
-    }
+static void p2_cpu_detect_apply(uint16* p) {
+    p[1] = 0x7200;  // moveq.l #0,d0     (was moveq.l #10,d0)
+    p[3] = 0x7200;  // moveq.l #0,d0     (was moveq.l #20,d0)
+}
 
-    p = FindMem(rom, size, p2_cpu_detect);
-    if (p) {
-        DPRINT("  Patching cpu detect at 0x%08x", (uint32)p);
-        p[1] = 0x7200; // moveq.l #0,d0     (was moveq.l #10,d0)
-        p[3] = 0x7200; // moveq.l #0,d0     (was moveq.l #20,d0)
-    }
+static void p2_rom_crc_apply(uint16* p) {
+    p[-5] = 0x4e71; // nop              (was bne.s fail)
+}
 
-    p = FindMem(rom, size, p2_rom_crc);
-    if (p) {
-        DPRINT("  Patching rom crc at 0x%08x", (uint32)p);
-        p[-5] = 0x4e71; // nop              (was bne.s fail)
-    }
+void PatchTos2(uint8* rom, uint32 size)
+{
+    const struct romPatch patches[] = {
+        { "wait",           p2_startup_waitvbl,     p2_startup_waitvbl_apply },
+        { "cpu detect",     p2_cpu_detect,          p2_cpu_detect_apply },
+        { "rom crc",        p2_rom_crc,             p2_rom_crc_apply },
+    };
+    PatchRom(rom, size, patches, sizeof(patches) / sizeof(patches[0]));
 }
 
 extern uint32* berrLastAdd;